@@ -0,0 +1,202 @@
+// AllocationTracker.C
+
+#include "AllocationTracker.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sys/resource.h>
+
+namespace {
+
+// Threads counted on their own; later threads share the last slot
+const int kMaxThreads = 256;
+
+// In front of every block; 16 bytes keep the alignment malloc gives
+struct alignas(16) Header {
+    std::size_t size;
+    int phase;
+};
+
+struct PhaseCounts {
+    std::atomic<long long> allocations{0}, frees{0}, bytes{0}, live{0}, peak{0};
+};
+
+// Written by one thread only, padded so neighbouring threads do not share a cache line
+struct alignas(64) ThreadCounts {
+    std::atomic<long long> allocations{0}, frees{0}, bytes{0};
+};
+
+// Constant-initialized, so allocations before main are counted too
+PhaseCounts phases[AllocationTracker::kPhases];
+ThreadCounts threads[kMaxThreads];
+std::atomic<long long> live_total(0), peak_total(0);
+std::atomic<int> n_threads(0);
+thread_local int current_phase = AllocationTracker::Setup;
+thread_local int thread_slot = -1;
+
+void raisePeak(std::atomic<long long>& peak, long long value) {
+    long long seen = peak.load(std::memory_order_relaxed);
+    while (value > seen && !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+ThreadCounts& threadCounts() {
+    if (thread_slot < 0) {
+        int slot = n_threads.fetch_add(1, std::memory_order_relaxed);
+        thread_slot = slot < kMaxThreads ? slot : kMaxThreads - 1;
+    }
+    return threads[thread_slot];
+}
+
+void printReport() {
+    AllocationTracker::print();
+}
+
+}  // namespace
+
+bool AllocationTracker::compiledIn() {
+#ifdef ENDCAP_ALLOC_TRACKING
+    return true;
+#else
+    return false;
+#endif
+}
+
+AllocationTracker::Scope::Scope(Phase phase) : previous(current_phase) {
+    current_phase = phase;
+}
+
+AllocationTracker::Scope::~Scope() {
+    current_phase = previous;
+}
+
+void* AllocationTracker::allocate(std::size_t size) {
+    Header* header = static_cast<Header*>(std::malloc(sizeof(Header) + size));
+    if (!header) return nullptr;
+    header->size = size;
+    header->phase = current_phase;
+
+    long long bytes = static_cast<long long>(size);
+    PhaseCounts& phase = phases[current_phase];
+    phase.allocations.fetch_add(1, std::memory_order_relaxed);
+    phase.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    raisePeak(phase.peak, phase.live.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    raisePeak(peak_total, live_total.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    ThreadCounts& thread = threadCounts();
+    thread.allocations.fetch_add(1, std::memory_order_relaxed);
+    thread.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    return header + 1;
+}
+
+void AllocationTracker::release(void* pointer) {
+    if (!pointer) return;
+    Header* header = static_cast<Header*>(pointer) - 1;
+    long long bytes = static_cast<long long>(header->size);
+    PhaseCounts& phase = phases[header->phase];
+    phase.frees.fetch_add(1, std::memory_order_relaxed);
+    phase.live.fetch_sub(bytes, std::memory_order_relaxed);
+    live_total.fetch_sub(bytes, std::memory_order_relaxed);
+    threadCounts().frees.fetch_add(1, std::memory_order_relaxed);
+    std::free(header);
+}
+
+AllocationTracker::Counts AllocationTracker::get(Phase phase) {
+    const PhaseCounts& counts = phases[phase];
+    return Counts{counts.allocations.load(), counts.frees.load(), counts.bytes.load(), counts.live.load(), counts.peak.load()};
+}
+
+long long AllocationTracker::getLive() {
+    return live_total.load();
+}
+
+long long AllocationTracker::getPeak() {
+    return peak_total.load();
+}
+
+void AllocationTracker::resetPeaks() {
+    for (auto& phase : phases) phase.peak = phase.live.load();
+    peak_total = live_total.load();
+}
+
+const char* AllocationTracker::phaseName(Phase phase) {
+    static const char* kNames[kPhases] = {"setup", "search state", "search", "results", "merging", "output"};
+    return kNames[phase];
+}
+
+void AllocationTracker::print() {
+    if (!compiledIn()) {
+        printf("Allocations: not counted, build with make ALLOC=1\n");
+        return;
+    }
+    printf("Allocations by phase:      allocations        frees     MB total    MB live    MB peak\n");
+    for (int phase = 0; phase < kPhases; ++phase) {
+        Counts counts = get(static_cast<Phase>(phase));
+        printf("%-24s %13lld %12lld %12.2f %10.2f %10.2f\n", phaseName(static_cast<Phase>(phase)), counts.allocations, counts.frees,
+               counts.bytes / 1048576.0, counts.live / 1048576.0, counts.peak / 1048576.0);
+    }
+    int n = std::min(n_threads.load(), kMaxThreads);
+    for (int slot = 0; slot < n; ++slot) {
+        char label[32];
+        snprintf(label, sizeof(label), slot + 1 < kMaxThreads ? "thread %d" : "threads %d+", slot + 1);
+        printf("%-24s %13lld %12lld %12.2f\n", label, threads[slot].allocations.load(), threads[slot].frees.load(),
+               threads[slot].bytes.load() / 1048576.0);
+    }
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Peak of all phases: %.2f MB allocated, %.2f MB resident\n", getPeak() / 1048576.0, usage.ru_maxrss / 1024.0);
+}
+
+void AllocationTracker::printAtExit() {
+    static bool registered = false;
+    if (!registered) std::atexit(printReport);
+    registered = true;
+}
+
+#ifdef ENDCAP_ALLOC_TRACKING
+// The aligned forms are left to the library: they allocate and free on their own, without these.
+void* operator new(std::size_t size) {
+    void* pointer = AllocationTracker::allocate(size);
+    if (!pointer) throw std::bad_alloc();
+    return pointer;
+}
+
+void* operator new[](std::size_t size) {
+    void* pointer = AllocationTracker::allocate(size);
+    if (!pointer) throw std::bad_alloc();
+    return pointer;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return AllocationTracker::allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return AllocationTracker::allocate(size);
+}
+
+void operator delete(void* pointer) noexcept {
+    AllocationTracker::release(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+    AllocationTracker::release(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    AllocationTracker::release(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept {
+    AllocationTracker::release(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+    AllocationTracker::release(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+    AllocationTracker::release(pointer);
+}
+#endif
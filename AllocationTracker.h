@@ -0,0 +1,72 @@
+// AllocationTracker.h
+
+#ifndef ALLOCATION_TRACKER_H
+#define ALLOCATION_TRACKER_H
+
+#include <cstddef>
+
+// Counts of operator new and delete per phase and per thread, with the live and peak bytes of every phase.
+// Compiled in with make ALLOC=1 (-DENDCAP_ALLOC_TRACKING), which replaces the global operator new and delete:
+// every block gets a 16-byte header with its size and the phase that allocated it, so a block freed in another
+// phase or thread still leaves the live bytes of its own phase. Otherwise ALLOC_PHASE expands to nothing and
+// nothing is counted. The phase of a thread is set by ALLOC_PHASE scopes and is Setup outside of them.
+class AllocationTracker {
+public:
+    enum Phase {
+        Setup,        // configuration, lattice, thread pool, and everything outside a scope
+        SearchState,  // the EndcapSearch of a task: its copy of the configuration and its caches
+        Search,       // temporaries of EndcapSearch::run
+        Results,      // configurations built by the search and the lists holding them
+        Merging,      // filtering and ordering the results of the tasks
+        Output,       // printing, the result store and the result cache
+        kPhases
+    };
+
+    struct Counts {
+        long long allocations;
+        long long frees;
+        long long bytes;  // allocated in total
+        long long live;   // allocated and not freed yet
+        long long peak;   // most live bytes at any time
+    };
+
+    static bool compiledIn();
+    static Counts get(Phase phase);
+    // Live bytes of all phases together, and the most at any time
+    static long long getLive();
+    static long long getPeak();
+    // Start the peaks again from the live bytes, to measure the peak of one part of a run
+    static void resetPeaks();
+    // Table per phase and per thread, with the peak resident set size of the process
+    static void print();
+    static void printAtExit();
+
+    static const char* phaseName(Phase phase);
+
+    // Tags the allocations of the calling thread with phase until destruction
+    class Scope {
+    public:
+        explicit Scope(Phase phase);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        int previous;
+    };
+
+    // Used by the replaced operator new and delete
+    static void* allocate(std::size_t size);
+    static void release(void* pointer);
+};
+
+#ifdef ENDCAP_ALLOC_TRACKING
+#define ALLOC_CONCAT_INNER(a, b) a##b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_INNER(a, b)
+#define ALLOC_PHASE(phase) AllocationTracker::Scope ALLOC_CONCAT(alloc_phase_, __LINE__)(AllocationTracker::phase)
+#else
+#define ALLOC_PHASE(phase)
+#endif
+
+#endif // ALLOCATION_TRACKER_H
@@ -0,0 +1,148 @@
+// AnnealingSearch.C
+
+#include "AnnealingSearch.h"
+#include "BoundedQueue.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <random>
+
+// One Metropolis chain with its own search stacks and random numbers
+struct AnnealingSearch::Chain {
+    Chain(const EndcapConfiguration& config, const ParameterLattice& lattice, const SearchOptions& options, unsigned long seed)
+        : cfg(config), search(config, lattice, 0, 0, options), rng(seed) {}
+
+    EndcapConfiguration cfg;  // working point for encode()
+    EndcapSearch search;
+    std::mt19937_64 rng;
+    int k[ParameterLattice::kMaxLevels];
+    double energy = 0;
+    double temperature = 1;
+    std::vector<EndcapConfiguration> results;
+    std::vector<AnytimeSearch::ScoredConfiguration> best;
+    long long evaluations = 0;
+};
+
+AnnealingSearch::AnnealingSearch(const EndcapConfiguration& config, const ParameterLattice& lattice, const SearchOptions& options,
+                                 EndcapOptimizer::Filter filter, AnytimeSearch::Score score, int n_best, const Settings& settings)
+    : config(config), lattice(lattice), options(options), filter(std::move(filter)), score(std::move(score)), n_best(std::max(n_best, 1)),
+      settings(settings) {
+    this->settings.chains = std::max(this->settings.chains, 1);
+    this->settings.round_steps = std::max(this->settings.round_steps, 1);
+    // The penalty needs the deepest ring reached, which only the outward chaining records
+    this->options.chain_method = ChainMethod::Forward;
+}
+
+static bool sameLayout(const EndcapConfiguration& a, const EndcapConfiguration& b) {
+    return a.getTypes() == b.getTypes() && a.getNpoly() == b.getNpoly() && a.getL1() == b.getL1() && a.getL2() == b.getL2();
+}
+
+void AnnealingSearch::insertBest(std::vector<AnytimeSearch::ScoredConfiguration>& list, double value, const EndcapConfiguration& cfg) const {
+    if (static_cast<int>(list.size()) == n_best && value <= list.back().score) return;
+    // Chains come back to the same points, keep each layout once
+    for (auto& scored : list) {
+        if (sameLayout(scored.config, cfg)) return;
+    }
+    auto position = std::upper_bound(list.begin(), list.end(), value,
+                                     [](double v, const AnytimeSearch::ScoredConfiguration& s) { return v > s.score; });
+    list.insert(position, AnytimeSearch::ScoredConfiguration{value, cfg});
+    if (static_cast<int>(list.size()) > n_best) list.pop_back();
+}
+
+// Energy of the lattice point k, clamped into the lattice in place: -score of the best configuration
+// passing the filter, 0.25 if configurations are built but none passes, 0.5 if chains reach the outer
+// ring but no sensor heights fit, and up to 1.5 the fewer rings the chaining gets through.
+double AnnealingSearch::evaluate(Chain& chain, int* k, long long& index) {
+    index = lattice.encode(chain.cfg, k);
+    if (index < 0) return std::numeric_limits<double>::infinity();
+
+    chain.results.clear();
+    chain.search.seek(index, index + 1);
+    chain.search.run(1, chain.results);
+    ++chain.evaluations;
+
+    double best_score = -std::numeric_limits<double>::infinity();
+    for (auto& cfg : chain.results) {
+        if (filter && !filter(cfg)) continue;
+        double value = score(cfg);
+        best_score = std::max(best_score, value);
+        insertBest(chain.best, value, cfg);
+    }
+    if (best_score > -std::numeric_limits<double>::infinity()) return -best_score;
+    if (!chain.results.empty()) return 0.25;
+
+    int free_rings = std::max(config.getNRings() - 1, 1);
+    return 0.5 + static_cast<double>(config.getNRings() - 1 - chain.search.getDeepestRing()) / free_rings;
+}
+
+// One Metropolis step: move one lattice level by one step or by a jump of up to a quarter of the L range
+void AnnealingSearch::step(Chain& chain) {
+    int n_levels = lattice.getNLevels();
+    int span = std::max(static_cast<int>((config.getLMax() - config.getLMin()) / lattice.getStep()), 1);
+    std::uniform_int_distribution<int> pick_level(0, n_levels - 1);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    int k[ParameterLattice::kMaxLevels];
+    std::copy(chain.k, chain.k + n_levels, k);
+    int level = pick_level(chain.rng);
+    int jump = uniform(chain.rng) < 0.5 ? 1 : std::uniform_int_distribution<int>(1, std::max(span / 4, 1))(chain.rng);
+    k[level] += uniform(chain.rng) < 0.5 ? -jump : jump;
+
+    long long index;
+    double energy = evaluate(chain, k, index);
+    if (index < 0) return;
+    if (energy <= chain.energy || uniform(chain.rng) < std::exp((chain.energy - energy) / chain.temperature)) {
+        std::copy(k, k + n_levels, chain.k);
+        chain.energy = energy;
+    }
+}
+
+void AnnealingSearch::run(ThreadPool& pool) {
+    if (lattice.size() == 0) return;
+    int n_chains = settings.chains;
+    std::mt19937_64 rng(settings.seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    std::vector<std::unique_ptr<Chain>> chains;
+    for (int c = 0; c < n_chains; ++c) {
+        chains.emplace_back(new Chain(config, lattice, options, settings.seed * 1000003 + c));
+        Chain& chain = *chains.back();
+        chain.temperature = n_chains > 1 ? settings.t_min * std::pow(settings.t_max / settings.t_min, static_cast<double>(c) / (n_chains - 1))
+                                         : settings.t_min;
+        // Start at a random lattice point
+        long long index = std::uniform_int_distribution<long long>(0, lattice.size() - 1)(rng);
+        lattice.decode(index, chain.cfg, chain.k);
+        chain.energy = evaluate(chain, chain.k, index);
+    }
+
+    BoundedQueue<int> finished(n_chains);
+    long rounds = (settings.steps + settings.round_steps - 1) / settings.round_steps;
+    for (long round = 0; round < rounds; ++round) {
+        for (auto& chain : chains) {
+            Chain* c = chain.get();
+            pool.submit([this, c, &finished]() {
+                for (int s = 0; s < settings.round_steps; ++s) step(*c);
+                finished.push(1);
+            });
+        }
+        for (int c = 0; c < n_chains; ++c) finished.pop();
+
+        // Swap the points of neighbouring temperatures, even pairs and odd pairs in turn
+        for (int c = round % 2; c + 1 < n_chains; c += 2) {
+            Chain& cold = *chains[c];
+            Chain& hot = *chains[c + 1];
+            double exponent = (1 / cold.temperature - 1 / hot.temperature) * (cold.energy - hot.energy);
+            if (exponent >= 0 || uniform(rng) < std::exp(exponent)) {
+                std::swap(cold.k, hot.k);
+                std::swap(cold.energy, hot.energy);
+                ++swaps;
+            }
+        }
+    }
+
+    for (auto& chain : chains) {
+        evaluations += chain->evaluations;
+        for (auto& scored : chain->best) insertBest(best, scored.score, scored.config);
+    }
+}
@@ -0,0 +1,59 @@
+// AnnealingSearch.h
+
+#ifndef ANNEALING_SEARCH_H
+#define ANNEALING_SEARCH_H
+
+#include "AnytimeSearch.h"
+#include "EndcapConfiguration.h"
+#include "EndcapOptimizer.h"
+#include "EndcapSearch.h"
+#include "ParameterLattice.h"
+#include "ThreadPool.h"
+#include <vector>
+
+// Stochastic search for lattices too large to scan, e.g. 5 species at fine steps.
+// Parallel tempering: n_chains Metropolis chains at geometrically spaced temperatures walk the L lattice
+// coordinates, and neighbouring chains swap temperatures between rounds. Every lattice point is judged by
+// the exact ring chaining and buildRadius of EndcapSearch. Points with configurations passing the filter
+// have energy -score; the others get a penalty that falls as the chaining gets closer to a layout.
+class AnnealingSearch {
+public:
+    struct Settings {
+        long steps = 100000;      // lattice points evaluated per chain
+        int chains = 8;
+        double t_min = 0.002;     // temperature of the coldest chain
+        double t_max = 0.5;       // temperature of the hottest chain
+        int round_steps = 100;    // steps between temperature swaps
+        unsigned long seed = 1;
+    };
+
+    AnnealingSearch(const EndcapConfiguration& config, const ParameterLattice& lattice, const SearchOptions& options, EndcapOptimizer::Filter filter,
+                    AnytimeSearch::Score score, int n_best, const Settings& settings);
+
+    void run(ThreadPool& pool);
+
+    // Best distinct configurations found, best first
+    const std::vector<AnytimeSearch::ScoredConfiguration>& getBest() const { return best; }
+    long long getEvaluations() const { return evaluations; }
+    long long getSwaps() const { return swaps; }
+
+private:
+    struct Chain;
+    double evaluate(Chain& chain, int* k, long long& index);
+    void step(Chain& chain);
+    void insertBest(std::vector<AnytimeSearch::ScoredConfiguration>& list, double value, const EndcapConfiguration& cfg) const;
+
+    const EndcapConfiguration& config;
+    const ParameterLattice& lattice;
+    SearchOptions options;
+    EndcapOptimizer::Filter filter;
+    AnytimeSearch::Score score;
+    int n_best;
+    Settings settings;
+
+    long long evaluations = 0;
+    long long swaps = 0;
+    std::vector<AnytimeSearch::ScoredConfiguration> best;
+};
+
+#endif // ANNEALING_SEARCH_H
@@ -0,0 +1,121 @@
+// AnytimeSearch.C
+
+#include "AnytimeSearch.h"
+#include "BoundedQueue.h"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+// Lattice points searched between two looks at the clock
+static const long kClockCheckPoints = 1024;
+
+static double minCostheta(const EndcapConfiguration& cfg) {
+    auto& radius = cfg.getRadius();
+    double worst = 1;
+    for (int i = 0; i < cfg.getNRings(); ++i) {
+        worst = std::min(worst, (radius[i][1] - radius[i][0]) / cfg.getHr()[cfg.getTypes()[i]]);
+    }
+    return worst;
+}
+
+static double meanCostheta(const EndcapConfiguration& cfg) {
+    auto& radius = cfg.getRadius();
+    double sum = 0;
+    for (int i = 0; i < cfg.getNRings(); ++i) {
+        sum += (radius[i][1] - radius[i][0]) / cfg.getHr()[cfg.getTypes()[i]];
+    }
+    return sum / cfg.getNRings();
+}
+
+AnytimeSearch::Score AnytimeSearch::scoreByName(const TString& name) {
+    if (name == "min_costheta") return minCostheta;
+    if (name == "mean_costheta") return meanCostheta;
+    return Score();
+}
+
+AnytimeSearch::AnytimeSearch(const EndcapConfiguration& config, const ParameterLattice& lattice, const SearchOptions& options,
+                             EndcapOptimizer::Filter filter, Score score, int n_best, int block_points)
+    : config(config), lattice(lattice), options(options), filter(std::move(filter)), score(std::move(score)),
+      n_best(std::max(n_best, 1)), block_points(std::max(block_points, 1)), next_order(0) {
+    n_blocks = (lattice.size() + this->block_points - 1) / this->block_points;
+    order_bits = 0;
+    while ((1LL << order_bits) < n_blocks) ++order_bits;
+}
+
+// Next block in bit-reversed order, or -1 once every block has been handed out
+long long AnytimeSearch::nextBlock() {
+    long long n_order = 1LL << order_bits;
+    for (;;) {
+        long long i = next_order++;
+        if (i >= n_order) return -1;
+        long long block = 0;
+        for (int bit = 0; bit < order_bits; ++bit) {
+            if (i & (1LL << bit)) block |= 1LL << (order_bits - 1 - bit);
+        }
+        if (block < n_blocks) return block;
+    }
+}
+
+void AnytimeSearch::insertBest(std::vector<ScoredConfiguration>& list, double value, const EndcapConfiguration& cfg) const {
+    if (static_cast<int>(list.size()) == n_best && value <= list.back().score) return;
+    auto position = std::upper_bound(list.begin(), list.end(), value,
+                                     [](double v, const ScoredConfiguration& s) { return v > s.score; });
+    list.insert(position, ScoredConfiguration{value, cfg});
+    if (static_cast<int>(list.size()) > n_best) list.pop_back();
+}
+
+void AnytimeSearch::run(ThreadPool& pool, double seconds, long long max_points) {
+    using Clock = std::chrono::steady_clock;
+    auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    std::atomic<long long> claimed(0);
+    std::mutex merge_mutex;
+    BoundedQueue<int> finished(pool.size());
+
+    for (int t = 0; t < pool.size(); ++t) {
+        pool.submit([&]() {
+            std::vector<ScoredConfiguration> local_best;
+            std::vector<EndcapConfiguration> config_list;
+            long long local_points = 0;
+            long local_results = 0;
+            bool out_of_time = false;
+
+            while (!out_of_time) {
+                long long block = nextBlock();
+                if (block < 0) break;
+                long long begin = block * block_points;
+                long long end = std::min(begin + block_points, lattice.size());
+                if (max_points > 0) {
+                    long long before = claimed.fetch_add(end - begin);
+                    if (before >= max_points) break;
+                    end = std::min(end, begin + (max_points - before));
+                }
+
+                EndcapSearch search(config, lattice, begin, end, options);
+                for (;;) {
+                    if (seconds > 0 && Clock::now() >= deadline) {
+                        out_of_time = true;
+                        break;
+                    }
+                    config_list.clear();
+                    long visited = search.run(kClockCheckPoints, config_list);
+                    if (visited == 0) break;
+                    local_points += visited;
+                    for (auto& cfg : config_list) {
+                        if (filter && !filter(cfg)) continue;
+                        ++local_results;
+                        insertBest(local_best, score(cfg), cfg);
+                    }
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(merge_mutex);
+                points_done += local_points;
+                n_results += local_results;
+                for (auto& scored : local_best) insertBest(best, scored.score, scored.config);
+            }
+            finished.push(1);
+        });
+    }
+    for (int t = 0; t < pool.size(); ++t) finished.pop();
+}
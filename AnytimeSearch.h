@@ -0,0 +1,66 @@
+// AnytimeSearch.h
+
+#ifndef ANYTIME_SEARCH_H
+#define ANYTIME_SEARCH_H
+
+#include "EndcapConfiguration.h"
+#include "EndcapOptimizer.h"
+#include "EndcapSearch.h"
+#include "ParameterLattice.h"
+#include "ThreadPool.h"
+#include <TString.h>
+#include <functional>
+#include <vector>
+
+// Budgeted search that can be stopped at any time with a useful answer.
+// The lattice is cut into blocks of consecutive points, visited in bit-reversed (van der Corput) block order:
+// after any prefix the visited blocks are spread evenly over the index range, i.e. over the outer L loops,
+// and every block is visited once the budget allows a full pass. The best configurations under a score
+// are kept as the search goes.
+class AnytimeSearch {
+public:
+    // Higher is better
+    using Score = std::function<double(const EndcapConfiguration&)>;
+
+    struct ScoredConfiguration {
+        double score;
+        EndcapConfiguration config;
+    };
+
+    AnytimeSearch(const EndcapConfiguration& config, const ParameterLattice& lattice, const SearchOptions& options,
+                  EndcapOptimizer::Filter filter, Score score, int n_best, int block_points = 4096);
+
+    // Search on the pool until seconds of wall time or max_points lattice points are spent (<= 0: no limit)
+    // or the lattice is exhausted.
+    void run(ThreadPool& pool, double seconds, long long max_points);
+
+    // Best configurations found, best first
+    const std::vector<ScoredConfiguration>& getBest() const { return best; }
+    long long getPointsDone() const { return points_done; }
+    double getCoverage() const { return lattice.size() > 0 ? static_cast<double>(points_done) / lattice.size() : 1; }
+    long getResults() const { return n_results; }
+
+    // Score by name: min_costheta (the flattest worst ring) or mean_costheta; an empty function for unknown names.
+    static Score scoreByName(const TString& name);
+
+private:
+    long long nextBlock();
+    void insertBest(std::vector<ScoredConfiguration>& list, double score, const EndcapConfiguration& cfg) const;
+
+    const EndcapConfiguration& config;
+    const ParameterLattice& lattice;
+    SearchOptions options;
+    EndcapOptimizer::Filter filter;
+    Score score;
+    int n_best;
+    int block_points;
+    long long n_blocks;
+    int order_bits;
+
+    std::atomic<long long> next_order;
+    long long points_done = 0;
+    long n_results = 0;
+    std::vector<ScoredConfiguration> best;
+};
+
+#endif // ANYTIME_SEARCH_H
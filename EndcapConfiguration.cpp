@@ -1,9 +1,34 @@
 // EndcapConfiguration.C
 
 #include "EndcapConfiguration.h"
+#include "RingKernels.h"
 #include <TEnv.h>
 #include <TMath.h>
+#include <algorithm>
 #include <iostream>
+#include <limits>
+
+// Polygons with fewer sides than this have their radius denominators tabulated
+static const int kTabulatedSides = 1024;
+
+// 2 sin(pi/n) and 2 tan(pi/n), evaluated with the same expressions as the radius functions below,
+// so a radius from the table is the same double as one computed directly
+struct PolygonDenominators {
+    double sin_den[kTabulatedSides];
+    double tan_den[kTabulatedSides];
+
+    PolygonDenominators() {
+        for (int n = 0; n < kTabulatedSides; n++) {
+            sin_den[n] = n > 2 ? 2 * TMath::Sin(TMath::Pi() / n) : 0;
+            tan_den[n] = n > 2 ? 2 * TMath::Tan(TMath::Pi() / n) : 0;
+        }
+    }
+};
+
+static const PolygonDenominators& polygonDenominators() {
+    static const PolygonDenominators table;
+    return table;
+}
 
 EndcapConfiguration::EndcapConfiguration(TEnv& config) {
     loadConfiguration(config);
@@ -16,6 +41,7 @@ void EndcapConfiguration::loadConfiguration(TEnv& config) {
     L_max = config.GetValue("L_max", 85.0);
     Hreal_min = config.GetValue("Hreal_min", 75.0);
     Hreal_max = config.GetValue("Hreal_max", 145.0);
+    hr_grid_step = 0;
     costheta_min = config.GetValue("costheta_min", 0.7);
     costheta_max = config.GetValue("costheta_max", 1.0);
     Gap_tolerance = config.GetValue("Gap_tolerance", 1e-3);
@@ -62,6 +88,7 @@ EndcapConfiguration::EndcapConfiguration(const EndcapConfiguration& other) {
     npoly = other.npoly;
     types = other.types;
     radius = other.radius;
+    // hr_grid is a cache of buildRadius, rebuilt by the copy when it needs it
 }
 
 void EndcapConfiguration::initializeDefaultValues() {
@@ -73,6 +100,22 @@ void EndcapConfiguration::initializeDefaultValues() {
     types[N_rings - 1] = N_species - 1;
 }
 
+void EndcapConfiguration::setDiskBounds(double r_min, double r_max, int n_min, int n_max) {
+    R_min = r_min;
+    R_max = r_max;
+    N_min = n_min;
+    N_max = n_max;
+    initializeDefaultValues();
+}
+
+void EndcapConfiguration::setNRings(int n_rings) {
+    N_rings = n_rings;
+    npoly.assign(N_rings, 0);
+    types.assign(N_rings, 0);
+    radius.assign(N_rings, std::array<double, 2>{0.0, 0.0});
+    initializeDefaultValues();
+}
+
 double EndcapConfiguration::getInnerRadius(int ringn) {
     return CircumscribedRadius(L1[types[ringn]], npoly[ringn]);
 }
@@ -81,46 +124,94 @@ double EndcapConfiguration::getOuterRadius(int ringn) {
     return InscribedRadius(L2[types[ringn]], npoly[ringn]);
 }
 
+// Hr values buildRadius tries, accumulated as the loop over h always did, padded for firstHrIndex
+void EndcapConfiguration::buildHrGrid(double step) {
+    hr_grid.clear();
+    for (double h = Hreal_min; h <= Hreal_max; h += step) hr_grid.push_back(h);
+    hr_grid_points = static_cast<int>(hr_grid.size());
+    hr_grid.resize((hr_grid.size() + kHrLanes - 1) / kHrLanes * kHrLanes, std::numeric_limits<double>::quiet_NaN());
+    hr_grid_step = step;
+}
+
 // buildRadius returns 1 if build success.
 int EndcapConfiguration::buildRadius(double step) {
     // First, calculate all radii
-    for (int i = 0; i < N_rings; i++) {
-        radius[i][0] = CircumscribedRadius(L1[types[i]], npoly[i]);
-        radius[i][1] = InscribedRadius(L2[types[i]], npoly[i]);
+    bool tabulated = true;
+    for (int i = 0; i < N_rings; i++) tabulated = tabulated && npoly[i] > 2 && npoly[i] < kTabulatedSides;
+    if (tabulated) {
+        const PolygonDenominators& table = polygonDenominators();
+        ringRadii(L1.data(), L2.data(), types.data(), npoly.data(), N_rings, table.sin_den, table.tan_den, radius[0].data());
+    } else {
+        for (int i = 0; i < N_rings; i++) {
+            radius[i][0] = CircumscribedRadius(L1[types[i]], npoly[i]);
+            radius[i][1] = InscribedRadius(L2[types[i]], npoly[i]);
+        }
     }
 
-    // Now, determine Hr for each sensor type
+    // Now, determine Hr for each sensor type: the smallest h on the grid that every ring of the type accepts,
+    // which is the first one the highest and the lowest of its rings both accept
+    if (hr_grid_step != step) buildHrGrid(step);
     for (int type = 0; type < N_species; type++) {
-        bool foundValidHr = false;
-        for (double h = Hreal_min; h <= Hreal_max; h += step) {
-            bool validForAllRings = true;
-            
-            // Check this Hr value against all rings of this sensor type
-            for (int i = 0; i < N_rings; i++) {
-                if (types[i] == type) {
-                    double ringHeight = radius[i][1] - radius[i][0];
-                    if (!(ringHeight > h * costheta_min && ringHeight < h * costheta_max)) {
-                        validForAllRings = false;
-                        break;
-                    }
-                }
-            }
-
-            if (validForAllRings) {
-                Hr[type] = h;
-                foundValidHr = true;
-                break;
+        double lowest = std::numeric_limits<double>::infinity();
+        double tallest = -std::numeric_limits<double>::infinity();
+        for (int i = 0; i < N_rings; i++) {
+            if (types[i] == type) {
+                double ringHeight = radius[i][1] - radius[i][0];
+                lowest = std::min(lowest, ringHeight);
+                tallest = std::max(tallest, ringHeight);
             }
         }
 
-        if (!foundValidHr) {
+        int found = firstHrIndex(hr_grid.data(), hr_grid_points, lowest, tallest, costheta_min, costheta_max);
+        if (found < 0) {
             return 0; // Build failed
         }
+        Hr[type] = hr_grid[found];
     }
 
     return 1; // Build succeeded
 }
 
+// The chaining accepts a ring of inner radius r_next after an outer radius r if
+// r(1 - Gap_tolerance) <= r_next <= r + Overlap_max_mm, and the outer ring if r - Overlap_max_mm <= r_next <= r(1 + Gap_tolerance).
+// The outer ring is checked with N_max sides before it gets its own npoly, so its r_next is not radius[N_rings-1][0].
+// buildRadius takes the smallest Hr on the grid below costheta_max, which does not depend on costheta_min.
+double EndcapConfiguration::checkedInnerRadius(int ring) const {
+    return ring + 1 == N_rings ? CircumscribedRadius(L1[types[ring]], N_max) : radius[ring][0];
+}
+
+EndcapConfiguration::ToleranceSlack EndcapConfiguration::computeSlack() const {
+    const double inf = std::numeric_limits<double>::infinity();
+    ToleranceSlack slack{-inf, -inf, inf};
+    for (int i = 1; i < N_rings; i++) {
+        double r = radius[i - 1][1];
+        double r_next = checkedInnerRadius(i);
+        bool outer = i + 1 == N_rings;
+        slack.gap = std::max(slack.gap, (outer ? r_next - r : r - r_next) / r);
+        slack.overlap = std::max(slack.overlap, outer ? r - r_next : r_next - r);
+    }
+    for (int i = 0; i < N_rings; i++) {
+        slack.costheta = std::min(slack.costheta, (radius[i][1] - radius[i][0]) / Hr[types[i]]);
+    }
+    return slack;
+}
+
+bool EndcapConfiguration::passesTolerances(double gap_tolerance, double overlap_max, double costheta_min) const {
+    for (int i = 1; i < N_rings; i++) {
+        double r = radius[i - 1][1];
+        double r_next = checkedInnerRadius(i);
+        if (i + 1 == N_rings) {
+            if (!(r_next >= r - overlap_max && r_next <= r * (1 + gap_tolerance))) return false;
+        } else {
+            if (!(r_next >= r * (1 - gap_tolerance) && r_next <= r + overlap_max)) return false;
+        }
+    }
+    for (int i = 0; i < N_rings; i++) {
+        if (!(radius[i][1] - radius[i][0] > Hr[types[i]] * costheta_min)) return false;
+    }
+    return true;
+}
+
 template <typename T>
 void printVector(const std::vector<T>& vec, const char* label, const char* format) {
     printf("%s: [", label);
@@ -162,6 +253,7 @@ double EndcapConfiguration::InscribedRadius(double L, int n) {
         std::cerr << "Error: A polygon must have at least 3 sides." << std::endl;
         return -9999.5;
     }
+    if (n < kTabulatedSides) return L / polygonDenominators().tan_den[n];
     return L / (2 * TMath::Tan(TMath::Pi() / n));
 }
 
@@ -171,6 +263,7 @@ double EndcapConfiguration::CircumscribedRadius(double L, int n) {
         std::cerr << "Error: A polygon must have at least 3 sides." << std::endl;
         return -9999.5;
     }
+    if (n < kTabulatedSides) return L / polygonDenominators().sin_den[n];
     return L / (2 * TMath::Sin(TMath::Pi() / n));
 }
 
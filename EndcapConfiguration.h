@@ -14,17 +14,33 @@ class EndcapConfiguration {
 void inline initializeDefaultValues();
 
 public:
+    // Loosest tolerances a built configuration needs: it is accepted for every Gap_tolerance >= gap and
+    // Overlap_max_mm >= overlap, and for every costheta_min < costheta (at the same costheta_max and step).
+    struct ToleranceSlack {
+        double gap;
+        double overlap;
+        double costheta;
+    };
+
     EndcapConfiguration(TEnv& config);
     EndcapConfiguration(const EndcapConfiguration& other);
+    // Moves keep the vectors, so result lists grow and hand configurations over without allocating
+    EndcapConfiguration(EndcapConfiguration&& other) noexcept = default;
+    EndcapConfiguration& operator=(const EndcapConfiguration& other) = default;
+    EndcapConfiguration& operator=(EndcapConfiguration&& other) noexcept = default;
     void loadConfiguration(TEnv& config);
     int buildRadius(double step);
+    // Slack of a configuration built by buildRadius
+    ToleranceSlack computeSlack() const;
+    // Exact ring transition and tilt checks of the search, repeated on a built configuration at other tolerances
+    bool passesTolerances(double gap_tolerance, double overlap_max, double costheta_min) const;
     void printConfiguration() const;
 
     // Getter methods
     double getRMin() const { return R_min; }
     double getRMax() const { return R_max; }
-    double getLMin() { return L_min; }
-    double getLMax() { return L_max; }
+    double getLMin() const { return L_min; }
+    double getLMax() const { return L_max; }
     double getHrealMin() const { return Hreal_min; }
     double getHrealMax() const { return Hreal_max; }
     double getCosthetaMin() const { return costheta_min; }
@@ -44,12 +60,16 @@ public:
     void setRMax(double max) { R_max = max; }
     void setLMin(double min) { L_min = min; }
     void setLMax(double max) { L_max = max; }
-    void setHrealMin(double min) { Hreal_min = min; }
-    void setHrealMax(double max) { Hreal_max = max; }
+    void setHrealMin(double min) { Hreal_min = min; hr_grid_step = 0; }
+    void setHrealMax(double max) { Hreal_max = max; hr_grid_step = 0; }
     void setCosthetaMin(double min) { costheta_min = min; }
     void setCosthetaMax(double max) { costheta_max = max; }
     void setGapTolerance(double tol) { Gap_tolerance = tol; }
     void setOverlapMax(double max) { Overlap_max_mm = max; }
+    // Move the disk to another radial segment; recomputes the fixed L1[0] and L2[N_species-1]
+    void setDiskBounds(double r_min, double r_max, int n_min, int n_max);
+    // Resize to n_rings rings with the fixed inner and outer ring; the rings between them are cleared
+    void setNRings(int n_rings);
 
     double static InscribedRadius(double L, int n);
     double static CircumscribedRadius(double L, int n);
@@ -61,6 +81,12 @@ public:
     std::vector<int>& getNpoly() { return npoly; }
     std::vector<int>& getTypes() { return types; }
     std::vector<std::array<double, 2>>& getRadius() { return radius; }
+    const std::vector<double>& getL1() const { return L1; }
+    const std::vector<double>& getL2() const { return L2; }
+    const std::vector<double>& getHr() const { return Hr; }
+    const std::vector<int>& getNpoly() const { return npoly; }
+    const std::vector<int>& getTypes() const { return types; }
+    const std::vector<std::array<double, 2>>& getRadius() const { return radius; }
 
 private:
     double R_max, R_min, L_min, L_max;
@@ -73,6 +99,14 @@ private:
     std::vector<double> L1, L2, Hr;
     std::vector<int> npoly, types;
     std::vector<std::array<double, 2>> radius;
+
+    // Inner radius the search checked ring against: N_max sides for the outer ring
+    double checkedInnerRadius(int ring) const;
+    void buildHrGrid(double step);
+    // Hr grid of buildRadius for hr_grid_step (0: none yet), hr_grid_points values padded with NaN
+    std::vector<double> hr_grid;
+    int hr_grid_points = 0;
+    double hr_grid_step = 0;
 };
 
 #endif // ENDCAP_CONFIGURATION_H
\ No newline at end of file
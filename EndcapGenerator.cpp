@@ -0,0 +1,18 @@
+// EndcapGenerator.C
+
+#include "EndcapGenerator.h"
+
+EndcapGenerator::EndcapGenerator(const EndcapConfiguration& config, const ParameterLattice& lattice, long long begin, long long end,
+                                 const SearchOptions& options)
+    : search(config, lattice, begin, end, options) {}
+
+bool EndcapGenerator::next(EndcapConfiguration& config) {
+    // One lattice point at a time, most of them build nothing
+    while (next_pending == pending.size()) {
+        pending.clear();
+        next_pending = 0;
+        if (search.run(1, pending) == 0) return false;
+    }
+    config = pending[next_pending++];
+    return true;
+}
@@ -0,0 +1,35 @@
+// EndcapGenerator.h
+
+#ifndef ENDCAP_GENERATOR_H
+#define ENDCAP_GENERATOR_H
+
+#include "EndcapConfiguration.h"
+#include "EndcapSearch.h"
+#include "ParameterLattice.h"
+#include <vector>
+
+// Pull-based generator over the configurations of a lattice range, in the order of the full search.
+// Each call to next() searches only as many lattice points as it takes to find one more configuration,
+// so a caller can stop after the first few, interleave the search with its own work, or keep the
+// generator and resume it later.
+class EndcapGenerator {
+public:
+    EndcapGenerator(const EndcapConfiguration& config, const ParameterLattice& lattice, long long begin, long long end,
+                    const SearchOptions& options = SearchOptions());
+
+    // Copy the next configuration into config; false once the range is exhausted.
+    bool next(EndcapConfiguration& config);
+
+    bool isDone() const { return next_pending == pending.size() && search.isDone(); }
+    long getCycles() const { return search.getCycles(); }
+    // Index of the next lattice point to search
+    long long getPosition() const { return search.getPosition(); }
+
+private:
+    EndcapSearch search;
+    // Configurations of the last searched lattice point not yet returned
+    std::vector<EndcapConfiguration> pending;
+    std::size_t next_pending = 0;
+};
+
+#endif // ENDCAP_GENERATOR_H
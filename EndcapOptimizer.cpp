@@ -0,0 +1,123 @@
+// EndcapOptimizer.C
+
+#include "EndcapOptimizer.h"
+#include "AllocationTracker.h"
+#include "BoundedQueue.h"
+#include "Tracer.h"
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <map>
+#include <vector>
+
+// Lattice points per chunk, so that a window of chunks stays small in memory
+static const long long kChunkPoints = 1LL << 20;
+// Lattice points searched between two looks at the cancel flag
+static const long kCancelCheckPoints = 1L << 14;
+
+// Kept configurations of one chunk, passed from the search tasks to the calling thread
+struct ChunkResult {
+    long long chunk;
+    std::vector<EndcapConfiguration> configs;
+    RejectionStats rejections;
+    PhaseProfile profile;
+};
+
+EndcapOptimizer::EndcapOptimizer(const EndcapConfiguration& config, double step_length, const SearchOptions& options)
+    : config(config), lattice(config, step_length), options(options), begin(0), end(lattice.size()),
+      cancelled(false), points_done(0), n_results(0) {}
+
+void EndcapOptimizer::setShard(int shard_index, int shard_count) {
+    begin = lattice.size() * shard_index / shard_count;
+    end = lattice.size() * (shard_index + 1) / shard_count;
+}
+
+long EndcapOptimizer::run(const ResultCallback& on_result, int n_threads) {
+    ThreadPool pool(n_threads);
+    return run(pool, on_result);
+}
+
+// The pool threads search and filter chunks while the calling thread delivers finished chunks in index order.
+// At most a window of chunks is in flight, so memory is bounded by the window and not by the result count.
+// run() waits for its own chunks only, not for the pool, so other work can share the pool.
+long EndcapOptimizer::run(ThreadPool& pool, const ResultCallback& on_result) {
+    if (config.getNspecies() < 3) {
+        std::cerr << "Unsupported number of species: " << config.getNspecies() << std::endl;
+        return 0;
+    }
+    // Each run starts afresh, also after an earlier run was cancelled
+    cancelled = false;
+    points_done = 0;
+    n_results = 0;
+    rejections = RejectionStats();
+    profile = PhaseProfile();
+
+    long long n_points = end > begin ? end - begin : 0;
+    long long n_chunks = std::min<long long>(n_points, std::max<long long>(16LL * pool.size(), (n_points + kChunkPoints - 1) / kChunkPoints));
+    long long window = 4LL * pool.size();
+    BoundedQueue<ChunkResult> queue(window);
+
+    // Counters of the delivery on the calling thread
+    PerfCounters counters;
+    PerfCounters::Sample before, after;
+    if (options.profile_phases && counters.open()) profile.setAvailable(counters.getAvailable());
+
+    long long submitted = 0, received = 0, delivered = 0;
+    std::map<long long, std::vector<EndcapConfiguration>> ready;  // finished chunks waiting for an earlier one
+    for (;;) {
+        ALLOC_PHASE(Merging);
+        // Keep the search tasks up to a window ahead of the delivery
+        for (; !cancelled && submitted < n_chunks && submitted < delivered + window; ++submitted) {
+            long long chunk = submitted;
+            long long chunk_begin = begin + n_points * chunk / n_chunks;
+            long long chunk_end = begin + n_points * (chunk + 1) / n_chunks;
+            pool.submit([=, &queue]() {
+                TRACE_SPAN("chunk", Tasks);
+                ALLOC_PHASE(SearchState);
+                std::vector<EndcapConfiguration> configs, kept;
+                EndcapSearch search(config, lattice, chunk_begin, chunk_end, options);
+                PerfCounters counters;
+                PerfCounters::Sample before, after, merging{};
+                if (options.profile_phases) counters.open();
+                while (!cancelled) {
+                    long visited = search.run(kCancelCheckPoints, configs);
+                    if (visited == 0) break;
+                    points_done += visited;
+                    ALLOC_PHASE(Merging);
+                    // Filter as the search goes, so only kept configurations pile up in the chunk
+                    counters.read(before);
+                    for (auto& cfg : configs) {
+                        if (!filter || filter(cfg)) kept.push_back(std::move(cfg));
+                    }
+                    configs.clear();
+                    counters.read(after);
+                    PerfCounters::Sample delta = counters.elapsed(before, after, 1);
+                    for (int event = 0; event < PerfCounters::kEvents; ++event) merging.value[event] += delta.value[event];
+                }
+                ChunkResult result{chunk, std::move(kept), search.getRejections(), search.getProfile()};
+                if (counters.isOpen()) result.profile.add(PhaseProfile::Merging, merging);
+                queue.push(std::move(result));
+            });
+        }
+        if (received == submitted) break;
+
+        ChunkResult result = queue.pop();
+        ++received;
+        counters.read(before);
+        if (options.count_rejections) rejections.merge(result.rejections);
+        if (options.profile_phases) profile.merge(result.profile);
+        ready[result.chunk] = std::move(result.configs);
+        for (auto it = ready.find(delivered); it != ready.end(); it = ready.find(delivered)) {
+            for (auto& cfg : it->second) {
+                if (cancelled) break;
+                on_result(cfg);
+                ++n_results;
+            }
+            ready.erase(it);
+            ++delivered;
+        }
+        counters.read(after);
+        if (counters.isOpen()) profile.add(PhaseProfile::Merging, counters.elapsed(before, after, 1));
+    }
+    return n_results;
+}
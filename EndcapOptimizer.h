@@ -0,0 +1,76 @@
+// EndcapOptimizer.h
+
+#ifndef ENDCAP_OPTIMIZER_H
+#define ENDCAP_OPTIMIZER_H
+
+#include "EndcapConfiguration.h"
+#include "EndcapSearch.h"
+#include "ParameterLattice.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <functional>
+
+// One optimization of an endcap configuration, for use from other programs.
+// run() searches the lattice on a thread pool and hands every configuration passing the filter to a
+// callback on the calling thread, in lattice index order. All state lives in the object, so several
+// optimizers can run at the same time, each from its own thread, on one shared pool or on their own.
+// cancel() and the progress getters may be called from any thread while run() is working.
+// run() may be called again; each run resets the cancel flag, the progress, the result count and the statistics.
+class EndcapOptimizer {
+public:
+    using ResultCallback = std::function<void(EndcapConfiguration&)>;
+    // Called on the pool threads; must not modify shared state.
+    using Filter = std::function<bool(EndcapConfiguration&)>;
+
+    EndcapOptimizer(const EndcapConfiguration& config, double step_length, const SearchOptions& options = SearchOptions());
+
+    EndcapOptimizer(const EndcapOptimizer&) = delete;
+    EndcapOptimizer& operator=(const EndcapOptimizer&) = delete;
+
+    // Search only slice shard_index of shard_count equal slices of the lattice. Call before run().
+    void setShard(int shard_index, int shard_count);
+    // Search only the lattice points with index in [begin, end). Call before run().
+    void setRange(long long begin, long long end) {
+        this->begin = begin;
+        this->end = end;
+    }
+    // Keep only the configurations the filter accepts; all are kept by default. Call before run().
+    void setFilter(Filter filter) { this->filter = std::move(filter); }
+
+    // Search on the caller's pool, or on an internal pool of n_threads threads (<= 0: hardware threads).
+    // Returns the number of configurations passed to on_result.
+    long run(ThreadPool& pool, const ResultCallback& on_result);
+    long run(const ResultCallback& on_result, int n_threads = 0);
+
+    // Stop the run in progress as soon as possible; run() returns after the chunks in flight have stopped,
+    // without delivering anything further. The optimizer stays cancelled until the next run() starts.
+    void cancel() { cancelled = true; }
+    bool isCancelled() const { return cancelled; }
+
+    long long getLatticeSize() const { return lattice.size(); }
+    long long getBegin() const { return begin; }
+    long long getEnd() const { return end; }
+    // Lattice points searched so far, i.e. the cycles of the search
+    long long getPointsDone() const { return points_done; }
+    double getProgress() const { return end > begin ? static_cast<double>(points_done) / (end - begin) : 1; }
+    long getResults() const { return n_results; }
+    // Rejected candidates of the chunks searched, with SearchOptions::count_rejections; read after run().
+    const RejectionStats& getRejections() const { return rejections; }
+    // Performance counters per phase and thread, with SearchOptions::profile_phases; read after run().
+    const PhaseProfile& getProfile() const { return profile; }
+
+private:
+    EndcapConfiguration config;
+    ParameterLattice lattice;
+    SearchOptions options;
+    Filter filter;
+    long long begin, end;
+
+    std::atomic<bool> cancelled;
+    std::atomic<long long> points_done;
+    std::atomic<long> n_results;
+    RejectionStats rejections;
+    PhaseProfile profile;
+};
+
+#endif // ENDCAP_OPTIMIZER_H
@@ -0,0 +1,743 @@
+// EndcapSearch.C
+
+#include "EndcapSearch.h"
+#include "AllocationTracker.h"
+#include "RingKernels.h"
+#include "Tracer.h"
+#include <TMath.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+int inline RoundtoN(double i, int n) {
+    // Divide i by n, round to the nearest integer, and then multiply by n
+    return TMath::Nint(i / n) * n;
+}
+
+// Exact check that a ring with inner side length L1 can follow a ring of outer radius r: RejectionStats::kReasons
+// if it does, otherwise the reason, with the setting that would accept it in needed.
+static inline int nextRingCheck(double r, double L1, const EndcapConfiguration& config, double& needed) {
+    double polygonSides = EndcapConfiguration::PolygonSides(r, L1);
+    int n_star = static_cast<int>(std::floor(polygonSides));  // floor of PolygonSides
+
+    // Check both floor value and floor + 1 for divisibility by 8
+    for (int delta = 0; delta <= 1; ++delta) {
+        int adjusted_n_star = n_star + delta;
+
+        // Check if the adjusted n_star is divisible by 8
+        if (adjusted_n_star % 8 == 0) {
+            auto r_next = EndcapConfiguration::CircumscribedRadius(L1, adjusted_n_star);
+            auto r_maxn = r + config.getOverlapMax();
+            auto r_minn = r * (1 - config.getGapTolerance());
+            if (r_next < r_minn) {
+                needed = (r - r_next) / r;
+                return RejectionStats::Gap;
+            }
+            if (r_next > r_maxn) {
+                needed = r_next - r;
+                return RejectionStats::Overlap;
+            }
+            if (r_next > config.getRMax()) {
+                needed = r_next;
+                return RejectionStats::RMax;
+            }
+            return RejectionStats::kReasons;
+        }
+    }
+    // The accepted sides lie in [8m - 1, 8m + 1)
+    needed = std::fabs(polygonSides - 8 * std::round(polygonSides / 8)) - 1;
+    return RejectionStats::Divisibility;
+}
+
+static inline bool nextRingFits(double r, double L1, const EndcapConfiguration& config) {
+    double needed;
+    return nextRingCheck(r, L1, config, needed) == RejectionStats::kReasons;
+}
+
+// Exact check that the outer ring, of inner radius r_next, can follow a ring of outer radius r; as nextRingCheck.
+static inline int outerRingCheck(double r, double r_next, const EndcapConfiguration& config, double& needed) {
+    if (r_next < r - config.getOverlapMax()) {
+        needed = r - r_next;
+        return RejectionStats::Overlap;
+    }
+    if (r_next > r * (1 + config.getGapTolerance())) {
+        needed = (r_next - r) / r;
+        return RejectionStats::Gap;
+    }
+    return RejectionStats::kReasons;
+}
+
+static inline bool outerRingFits(double r, double r_next, const EndcapConfiguration& config) {
+    double needed;
+    return outerRingCheck(r, r_next, config, needed) == RejectionStats::kReasons;
+}
+
+// Number of sides given to a ring of inner side length L1 following a ring of outer radius r.
+static inline int ringNpoly(double r, double L1) {
+    return RoundtoN(EndcapConfiguration::PolygonSides(r, L1), 8);
+}
+
+// find the n and type of the next ring using current l2 and n.
+int nextCircles(int currentRing, EndcapConfiguration& config, int* typenext) {
+    auto& L1 = config.getL1();
+    auto& types = config.getTypes();
+    int ntypes = 0;
+
+    if (currentRing < 1) {
+        std::cerr << "current ring cannot be lower than 1!";
+        return ntypes;
+    }
+
+    double r = config.getOuterRadius(currentRing - 1);
+
+    // check if the next ring is the outer ring
+    if (currentRing + 1 == config.getNRings()) {
+        if (outerRingFits(r, config.getInnerRadius(currentRing), config)) {
+            typenext[ntypes++] = types[currentRing];
+        }
+        return ntypes;
+    }
+
+    // Cheap float32 pass first; only the species it keeps go through the exact check
+    auto r_maxn = std::min(r + config.getOverlapMax(), config.getRMax());
+    auto r_minn = r * (1 - config.getGapTolerance());
+    float L1f[kPrefilterLanes];
+    int keep[kPrefilterLanes];
+    for (int i = 0; i < kPrefilterLanes; i++) {
+        L1f[i] = static_cast<float>(L1[i < config.getNspecies() ? i : 0]);
+    }
+    prefilterNextRing(r, L1f, config.getNspecies(), r_minn, r_maxn, keep);
+
+    for (int i = 0; i < config.getNspecies(); i++) {
+        if (keep[i] && nextRingFits(r, L1[i], config)) {
+            typenext[ntypes++] = i;
+        }
+    }
+    return ntypes;
+}
+
+// Search settings that are not part of the geometry
+int readSearchOptions(TEnv& configfile, SearchOptions& options, std::string& error) {
+    TString chain_search = configfile.GetValue("Chain_search", "forward");
+    if (chain_search == "forward") {
+        options.chain_method = ChainMethod::Forward;
+    } else if (chain_search == "bidirectional") {
+        options.chain_method = ChainMethod::Bidirectional;
+    } else if (chain_search == "dp") {
+        options.chain_method = ChainMethod::DynamicProgramming;
+    } else {
+        error = std::string("unknown Chain_search ") + chain_search.Data() + ", use forward, bidirectional or dp";
+        return 0;
+    }
+    options.count_rejections = configfile.GetValue("Search_diagnostics", 0) != 0;
+    options.profile_phases = configfile.GetValue("Perf_counters", 0) != 0;
+    options.max_rings = configfile.GetValue("N_rings_max", 0);
+    if (options.max_rings > EndcapSearch::kMaxRings) {
+        error = "N_rings_max is at most " + std::to_string(EndcapSearch::kMaxRings);
+        return 0;
+    }
+    if (options.max_rings > configfile.GetValue("N_rings", 3) && options.count_rejections) {
+        error = "Search_diagnostics needs a single ring count, unset N_rings_max";
+        return 0;
+    }
+    return 1;
+}
+
+// Multiples of 8 whose inscribed radius with side L may fall in [r_lo, r_hi]. The window is widened by
+// a relative 1e-9 so rounding in the inversion cannot drop a candidate; callers check each one exactly.
+static inline void npolyCandidates(double L, double r_lo, double r_hi, int& n_first, int& n_last) {
+    r_lo = std::max(r_lo * (1 - 1e-9), 0.5 * L);
+    r_hi = std::max(r_hi * (1 + 1e-9), r_lo);
+    double n_lo = TMath::Pi() / std::atan(L / (2 * r_lo));
+    double n_hi = TMath::Pi() / std::atan(L / (2 * r_hi));
+    n_first = std::max(8, 8 * static_cast<int>(std::ceil(n_lo / 8)));
+    n_last = 8 * static_cast<int>(std::floor(n_hi / 8));
+}
+
+EndcapSearch::EndcapSearch(const EndcapConfiguration& config, const ParameterLattice& lattice, long long begin, long long end,
+                           const SearchOptions& options)
+    : cfg(config), lattice(lattice), position(begin), end(end) {
+    N_species = cfg.getNspecies();
+    N_rings = cfg.getNRings();
+    step = lattice.getStep();
+    min_rings = N_rings;
+    if (options.max_rings > N_rings && N_rings >= 2) N_rings = options.max_rings;
+
+    if (N_species > kMaxSpecies || N_rings > kMaxRings) {
+        std::cerr << "Error: at most " << kMaxSpecies << " species and " << kMaxRings << " rings are supported." << std::endl;
+        done = true;
+        return;
+    }
+    // The lattice does not depend on the ring count, so every count is searched at each point
+    if (N_rings > min_rings) {
+        shorter.assign(N_rings - min_rings, cfg);
+        for (int n = min_rings; n < N_rings; ++n) shorter[n - min_rings].setNRings(n);
+        cfg.setNRings(N_rings);
+    }
+    outer_npoly = cfg.getNpoly()[N_rings - 1];
+
+    // Meeting in the middle only pays off once there are two or more free rings
+    if (options.chain_method == ChainMethod::Bidirectional && N_rings >= 4) {
+        join_ring = N_rings / 2;
+    }
+    use_dp = options.chain_method == ChainMethod::DynamicProgramming && N_rings >= 2;
+    // Both build whole chains of N_rings rings only
+    if (N_rings > min_rings) {
+        join_ring = 0;
+        use_dp = false;
+    }
+
+    cache_ring_states = options.cache_ring_states;
+    // Counting sees every transition only on the plain outward search
+    counting = options.count_rejections;
+    if (counting) {
+        join_ring = 0;
+        use_dp = false;
+        cache_ring_states = false;
+    }
+    profiling = options.profile_phases;
+    if (cache_ring_states) successor_cache.assign(1 + N_species * kCachedNpolySlots, StateSuccessors());
+}
+
+// Move the lattice stack to the next (L1, L2) point of the range; false once it is exhausted.
+bool EndcapSearch::nextPoint() {
+    if (done || position >= end) {
+        done = true;
+        return false;
+    }
+
+    if (!started) {
+        started = true;
+        lattice.decode(position, cfg, lattice_k);
+        ++epoch;
+    } else {
+        int changed = lattice.advance(cfg, lattice_k);
+        if (changed < 0) {
+            done = true;
+            return false;
+        }
+        if (changed != lattice.getNLevels() - 1) ++epoch;
+    }
+    ++position;
+    return true;
+}
+
+// Candidate types and npoly of ring after the state of ring-1 in cfg, the same as nextCircles followed by ringNpoly.
+// For a cached state only the species of the innermost lattice loop is checked again.
+int EndcapSearch::nextStates(int ring, int* typenext, int* npolynext) {
+    auto& L1 = cfg.getL1();
+    auto& npoly = cfg.getNpoly();
+    auto& types = cfg.getTypes();
+    int type = types[ring - 1];
+    int n = npoly[ring - 1];
+    double r = EndcapConfiguration::InscribedRadius(cfg.getL2()[type], n);
+
+    // Cache slot of the state; none for the outer ring, whose check depends on L1[N_species-1]
+    int slot = -1;
+    if (cache_ring_states && ring + 1 < N_rings) {
+        if (ring == 1) {
+            slot = 0;
+        } else if (n % 8 == 0 && n / 8 < kCachedNpolySlots) {
+            slot = 1 + type * kCachedNpolySlots + n / 8;
+        }
+    }
+
+    if (slot < 0) {
+        if (counting) return nextStatesCounted(ring, r, typenext, npolynext);
+        int ntypes = nextCircles(ring, cfg, typenext);
+        for (int c = 0; c < ntypes; ++c) {
+            npolynext[c] = ringNpoly(r, L1[typenext[c]]);
+        }
+        return ntypes;
+    }
+
+    int inner = N_species - 1;
+    StateSuccessors& entry = successor_cache[slot];
+    if (entry.epoch != epoch) {
+        entry.epoch = epoch;
+        entry.n = 0;
+        int ntypes = nextCircles(ring, cfg, typenext);
+        for (int c = 0; c < ntypes && typenext[c] < inner; ++c) {
+            entry.type[entry.n] = typenext[c];
+            entry.npoly[entry.n++] = ringNpoly(r, L1[typenext[c]]);
+        }
+    }
+
+    int ntypes = entry.n;
+    std::copy(entry.type, entry.type + ntypes, typenext);
+    std::copy(entry.npoly, entry.npoly + ntypes, npolynext);
+    if (nextRingFits(r, L1[inner], cfg)) {
+        typenext[ntypes] = inner;
+        npolynext[ntypes++] = ringNpoly(r, L1[inner]);
+    }
+    return ntypes;
+}
+
+// nextStates without the float32 prefilter, counting every rejected species
+int EndcapSearch::nextStatesCounted(int ring, double r, int* typenext, int* npolynext) {
+    auto& L1 = cfg.getL1();
+    double needed;
+    int ntypes = 0;
+    if (ring + 1 == N_rings) {
+        int type = cfg.getTypes()[ring];
+        rejections.countTried(ring);
+        int reason = outerRingCheck(r, cfg.getInnerRadius(ring), cfg, needed);
+        if (reason != RejectionStats::kReasons) {
+            rejections.reject(ring, static_cast<RejectionStats::Reason>(reason), needed);
+            return 0;
+        }
+        typenext[ntypes] = type;
+        npolynext[ntypes++] = ringNpoly(r, L1[type]);
+        return ntypes;
+    }
+    for (int i = 0; i < N_species; ++i) {
+        rejections.countTried(ring);
+        int reason = nextRingCheck(r, L1[i], cfg, needed);
+        if (reason != RejectionStats::kReasons) {
+            rejections.reject(ring, static_cast<RejectionStats::Reason>(reason), needed);
+            continue;
+        }
+        typenext[ntypes] = i;
+        npolynext[ntypes++] = ringNpoly(r, L1[i]);
+    }
+    return ntypes;
+}
+
+// Candidates of ring for the outward walk: the outer ring first if a layout of ring+1 rings is searched and the
+// outer ring fits, then the states of nextStates. The outer ring is checked as nextCircles does at its own ring.
+int EndcapSearch::ringStates(int ring) {
+    int n = 0;
+    if (ring + 1 >= min_rings && ring + 1 < N_rings) {
+        auto& L1 = cfg.getL1();
+        int outer = N_species - 1;
+        double r = cfg.getOuterRadius(ring - 1);
+        if (outerRingFits(r, EndcapConfiguration::CircumscribedRadius(L1[outer], outer_npoly), cfg)) {
+            ring_types[ring][n] = kCloseChain;
+            ring_npolys[ring][n++] = ringNpoly(r, L1[outer]);
+        }
+    }
+    return n + nextStates(ring, ring_types[ring] + n, ring_npolys[ring] + n);
+}
+
+// Size the chain set in chain and keep it if every species has an Hr
+inline void EndcapSearch::build(EndcapConfiguration& chain, std::vector<EndcapConfiguration>& config_list) {
+    TRACE_SPAN("buildRadius", Chains);
+    if (counting) rejections.countChain();
+    PerfCounters::Sample before, after;
+    if (sampling) counters.read(before);
+    int built = chain.buildRadius(step);
+    if (sampling) {
+        counters.read(after);
+        PerfCounters::Sample delta = PerfCounters::difference(before, after);
+        for (int event = 0; event < PerfCounters::kEvents; ++event) hr_counts.value[event] += delta.value[event];
+        ++hr_builds;
+    }
+    if (built) {
+        ALLOC_PHASE(Results);
+        config_list.push_back(chain);
+        if (counting) rejections.countBuilt();
+    } else if (counting) {
+        countHrRejection();
+    }
+}
+
+// Rings 0..ring-1 of cfg closed by the outer ring, with npoly_outer sides, as ring: the layout of ring+1 rings
+void EndcapSearch::buildShorter(int ring, int npoly_outer, std::vector<EndcapConfiguration>& config_list) {
+    EndcapConfiguration& chain = shorter[ring + 1 - min_rings];
+    // Same sizes, so the vectors are copied without allocating
+    chain.getL1() = cfg.getL1();
+    chain.getL2() = cfg.getL2();
+    std::copy(cfg.getTypes().begin(), cfg.getTypes().begin() + ring, chain.getTypes().begin());
+    std::copy(cfg.getNpoly().begin(), cfg.getNpoly().begin() + ring, chain.getNpoly().begin());
+    chain.getNpoly()[ring] = npoly_outer;
+    build(chain, config_list);
+}
+
+// The chain in cfg has no Hr for some species: count the first such species, as buildRadius stops there, on the
+// ring that decides. Every ring needs height < Hr * costheta_max, easiest for the largest Hr on the grid, and
+// height > Hr * costheta_min, easiest for the smallest Hr that satisfies the first.
+void EndcapSearch::countHrRejection() {
+    auto& radius = cfg.getRadius();
+    auto& types = cfg.getTypes();
+    auto height = [&radius](int i) { return radius[i][1] - radius[i][0]; };
+    for (int type = 0; type < N_species; ++type) {
+        int tallest = -1, lowest = -1;
+        for (int i = 0; i < N_rings; ++i) {
+            if (types[i] != type) continue;
+            if (tallest < 0 || height(i) > height(tallest)) tallest = i;
+            if (lowest < 0 || height(i) < height(lowest)) lowest = i;
+        }
+        if (tallest < 0) continue;
+
+        // Same grid as buildRadius
+        bool found = false;
+        double h_first = -1, h_last = -1;
+        for (double h = cfg.getHrealMin(); h <= cfg.getHrealMax() && !found; h += step) {
+            found = height(tallest) < h * cfg.getCosthetaMax() && height(lowest) > h * cfg.getCosthetaMin();
+            if (h_first < 0 && height(tallest) < h * cfg.getCosthetaMax()) h_first = h;
+            h_last = h;
+        }
+        if (found) continue;
+        if (h_first < 0) {
+            rejections.reject(tallest, RejectionStats::CosthetaMax,
+                              h_last > 0 ? height(tallest) / h_last : std::numeric_limits<double>::infinity());
+        } else {
+            rejections.reject(lowest, RejectionStats::CosthetaMin, height(lowest) / h_first);
+        }
+        return;
+    }
+}
+
+// Depth-first chaining of rings 1..N_rings-1 with an explicit stack, building every complete chain.
+// Chains closed before ring N_rings-1 are the shorter layouts of SearchOptions::max_rings.
+void EndcapSearch::exploreRings(std::vector<EndcapConfiguration>& config_list) {
+    TRACE_SPAN("exploreRings", Chains);
+    auto& npoly = cfg.getNpoly();
+    auto& types = cfg.getTypes();
+    int saved_type[kMaxRings];
+    int saved_npoly[kMaxRings];
+
+    if (N_rings < 2) {
+        build(config_list);
+        return;
+    }
+    // Too many states in a layer: fall back to the outward search
+    if (use_dp && exploreRingsDp(config_list)) return;
+
+    back_built = false;
+    deepest_ring = 0;
+    int ring = 1;
+    saved_type[ring] = types[ring];
+    saved_npoly[ring] = npoly[ring];
+    ring_ntypes[ring] = ringStates(ring);
+    ring_next[ring] = 0;
+
+    while (ring > 0) {
+        if (ring_next[ring] == ring_ntypes[ring]) {
+            // Every candidate tried: restore the ring and backtrack
+            types[ring] = saved_type[ring];
+            npoly[ring] = saved_npoly[ring];
+            --ring;
+            continue;
+        }
+
+        int type = ring_types[ring][ring_next[ring]];
+        int n = ring_npolys[ring][ring_next[ring]++];
+        if (type == kCloseChain) {
+            deepest_ring = N_rings - 1;
+            buildShorter(ring, n, config_list);
+            continue;
+        }
+        types[ring] = type;
+        npoly[ring] = n;
+        deepest_ring = std::max(deepest_ring, ring);
+
+        if (ring == join_ring) {
+            if (!back_built) {
+                back_ok = buildBackwardLayers();
+                back_built = true;
+            }
+            // Without the inward layers (too many states) keep chaining outward
+            if (back_ok) {
+                joinSuffixes(config_list);
+                continue;
+            }
+        }
+
+        if (ring + 1 >= N_rings) {
+            // buildRadius only writes radius and Hr, so the working configuration is copied on success only
+            build(config_list);
+            continue;
+        }
+
+        ++ring;
+        saved_type[ring] = types[ring];
+        saved_npoly[ring] = npoly[ring];
+        ring_ntypes[ring] = ringStates(ring);
+        ring_next[ring] = 0;
+    }
+}
+
+// Dynamic programming over ring states for the current lattice point. Layer k holds every (type, npoly)
+// that nextCircles can reach at ring k, however many chains lead to it, so each state is expanded once
+// and the work grows linearly with N_rings. States that cannot reach the outer ring are marked dead, and
+// the chains are rebuilt from ring 0 along live links only, in the order of the outward search.
+// Returns false if a layer overflows.
+bool EndcapSearch::exploreRingsDp(std::vector<EndcapConfiguration>& config_list) {
+    auto& L1 = cfg.getL1();
+    auto& L2 = cfg.getL2();
+    auto& npoly = cfg.getNpoly();
+    auto& types = cfg.getTypes();
+    int last = N_rings - 2;
+    int typenext[kMaxSpecies];
+    int npolynext[kMaxSpecies];
+
+    layer_count[0] = 1;
+    chain_layer[0][0] = ChainState{types[0], npoly[0], 0, {}, false};
+
+    for (int ring = 1; ring <= last; ++ring) {
+        ChainState* layer = chain_layer[ring];
+        int& count = layer_count[ring];
+        count = 0;
+
+        for (int j = 0; j < layer_count[ring - 1]; ++j) {
+            ChainState& state = chain_layer[ring - 1][j];
+            types[ring - 1] = state.type;
+            npoly[ring - 1] = state.npoly;
+            int ntypes = nextStates(ring, typenext, npolynext);
+
+            // nextStates returns the types in order, so the links are sorted by type
+            for (int c = 0; c < ntypes; ++c) {
+                int n = npolynext[c];
+                int k = 0;
+                while (k < count && (layer[k].type != typenext[c] || layer[k].npoly != n)) ++k;
+                if (k == count) {
+                    if (count == kMaxChainStates) return false;
+                    layer[count++] = ChainState{typenext[c], n, 0, {}, false};
+                }
+                state.next[state.n_next++] = k;
+            }
+        }
+    }
+
+    // The outer ring decides which states of the last free ring are live, the links the rest
+    double r_outer = EndcapConfiguration::CircumscribedRadius(L1[types[N_rings - 1]], outer_npoly);
+    for (int k = 0; k < layer_count[last]; ++k) {
+        ChainState& state = chain_layer[last][k];
+        state.live = outerRingFits(EndcapConfiguration::InscribedRadius(L2[state.type], state.npoly), r_outer, cfg);
+    }
+    for (int ring = last - 1; ring >= 0; --ring) {
+        for (int k = 0; k < layer_count[ring]; ++k) {
+            ChainState& state = chain_layer[ring][k];
+            for (int c = 0; c < state.n_next && !state.live; ++c) {
+                state.live = chain_layer[ring + 1][state.next[c]].live;
+            }
+        }
+    }
+
+    if (!chain_layer[0][0].live) return true;
+    if (last == 0) {
+        closeChain(config_list);
+        return true;
+    }
+
+    int ring = 0;
+    suffix_state[0] = 0;
+    suffix_pos[0] = 0;
+    while (ring >= 0) {
+        const ChainState& state = chain_layer[ring][suffix_state[ring]];
+        if (suffix_pos[ring] == state.n_next) {
+            --ring;
+            continue;
+        }
+
+        int j = state.next[suffix_pos[ring]++];
+        const ChainState& next = chain_layer[ring + 1][j];
+        if (!next.live) continue;
+        types[ring + 1] = next.type;
+        npoly[ring + 1] = next.npoly;
+        if (ring + 1 == last) {
+            closeChain(config_list);
+            continue;
+        }
+        ++ring;
+        suffix_state[ring] = j;
+        suffix_pos[ring] = 0;
+    }
+    return true;
+}
+
+// Build the inward layers for the current lattice point: layer N_rings-2 holds the states the outer ring
+// can follow, each layer below the states that nextCircles would chain to a state of the layer above.
+// Candidates come from the radius window and are kept only if the exact outward transition reproduces them.
+// Returns false if a layer overflows.
+bool EndcapSearch::buildBackwardLayers() {
+    auto& L1 = cfg.getL1();
+    auto& L2 = cfg.getL2();
+    auto byState = [](const ChainState& a, const ChainState& b) {
+        return a.type != b.type ? a.type < b.type : a.npoly < b.npoly;
+    };
+
+    int last = N_rings - 2;
+    layer_count[last] = 0;
+    double r_outer = EndcapConfiguration::CircumscribedRadius(L1[cfg.getTypes()[N_rings - 1]], outer_npoly);
+    double r_lo = r_outer / (1 + cfg.getGapTolerance());
+    double r_hi = r_outer + cfg.getOverlapMax();
+    for (int t = 0; t < N_species; ++t) {
+        int n_first, n_last;
+        npolyCandidates(L2[t], r_lo, r_hi, n_first, n_last);
+        for (int n = n_first; n <= n_last; n += 8) {
+            if (!outerRingFits(EndcapConfiguration::InscribedRadius(L2[t], n), r_outer, cfg)) continue;
+            if (layer_count[last] == kMaxChainStates) return false;
+            chain_layer[last][layer_count[last]++] = ChainState{t, n, 0, {}, true};
+        }
+    }
+    std::sort(chain_layer[last], chain_layer[last] + layer_count[last], byState);
+
+    for (int ring = last; ring > join_ring; --ring) {
+        ChainState* layer = chain_layer[ring - 1];
+        int& count = layer_count[ring - 1];
+        count = 0;
+
+        for (int j = 0; j < layer_count[ring]; ++j) {
+            const ChainState& state = chain_layer[ring][j];
+            double r_next = EndcapConfiguration::CircumscribedRadius(L1[state.type], state.npoly);
+            if (r_next > cfg.getRMax()) continue;
+            r_lo = r_next - cfg.getOverlapMax();
+            r_hi = r_next / (1 - cfg.getGapTolerance());
+
+            for (int t = 0; t < N_species; ++t) {
+                int n_first, n_last;
+                npolyCandidates(L2[t], r_lo, r_hi, n_first, n_last);
+                for (int n = n_first; n <= n_last; n += 8) {
+                    double r = EndcapConfiguration::InscribedRadius(L2[t], n);
+                    if (!nextRingFits(r, L1[state.type], cfg) || ringNpoly(r, L1[state.type]) != state.npoly) continue;
+
+                    int k = 0;
+                    while (k < count && (layer[k].type != t || layer[k].npoly != n)) ++k;
+                    if (k == count) {
+                        if (count == kMaxChainStates) return false;
+                        layer[count++] = ChainState{t, n, 0, {}, true};
+                    }
+                    layer[k].next[layer[k].n_next++] = j;  // one link per type of the next ring
+                }
+            }
+        }
+
+        std::sort(layer, layer + count, byState);
+        for (int k = 0; k < count; ++k) {
+            std::sort(layer[k].next, layer[k].next + layer[k].n_next);
+        }
+    }
+    return true;
+}
+
+int EndcapSearch::findChainState(int ring, int type, int npoly) const {
+    const ChainState* layer = chain_layer[ring];
+    int lo = 0, hi = layer_count[ring];
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (layer[mid].type < type || (layer[mid].type == type && layer[mid].npoly < npoly)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < layer_count[ring] && layer[lo].type == type && layer[lo].npoly == npoly ? lo : -1;
+}
+
+// The outward chain has reached join_ring: append every inward suffix of its state, in the order of
+// their types so the results come out as from the outward search alone.
+void EndcapSearch::joinSuffixes(std::vector<EndcapConfiguration>& config_list) {
+    auto& npoly = cfg.getNpoly();
+    auto& types = cfg.getTypes();
+
+    int start = findChainState(join_ring, types[join_ring], npoly[join_ring]);
+    if (start < 0) return;
+    if (join_ring == N_rings - 2) {
+        closeChain(config_list);
+        return;
+    }
+
+    int ring = join_ring;
+    suffix_state[ring] = start;
+    suffix_pos[ring] = 0;
+    while (ring >= join_ring) {
+        const ChainState& state = chain_layer[ring][suffix_state[ring]];
+        if (suffix_pos[ring] == state.n_next) {
+            --ring;
+            continue;
+        }
+
+        int j = state.next[suffix_pos[ring]++];
+        types[ring + 1] = chain_layer[ring + 1][j].type;
+        npoly[ring + 1] = chain_layer[ring + 1][j].npoly;
+        if (ring + 1 == N_rings - 2) {
+            closeChain(config_list);
+            continue;
+        }
+        ++ring;
+        suffix_state[ring] = j;
+        suffix_pos[ring] = 0;
+    }
+}
+
+// Rings 0..N_rings-2 are set and the outer ring is known to fit: size it and build the configuration.
+void EndcapSearch::closeChain(std::vector<EndcapConfiguration>& config_list) {
+    auto& L1 = cfg.getL1();
+    auto& L2 = cfg.getL2();
+    auto& npoly = cfg.getNpoly();
+    auto& types = cfg.getTypes();
+    int last = N_rings - 1;
+
+    double r = EndcapConfiguration::InscribedRadius(L2[types[last - 1]], npoly[last - 1]);
+    npoly[last] = ringNpoly(r, L1[types[last]]);
+    build(config_list);
+    npoly[last] = outer_npoly;
+}
+
+void EndcapSearch::seek(long long begin, long long end) {
+    position = begin;
+    this->end = end;
+    started = false;
+    done = false;
+}
+
+long EndcapSearch::run(long max_points, std::vector<EndcapConfiguration>& config_list) {
+    ALLOC_PHASE(Search);
+    if (profiling) return runProfiled(max_points, config_list);
+    long visited = 0;
+    while (visited < max_points && nextPoint()) {
+        ++visited;
+        ++cycles;
+        if (counting) rejections.countPoint();
+        exploreRings(config_list);
+    }
+    return visited;
+}
+
+// run() with the performance counters: the whole run is counted, and every kSampleInterval-th point phase by phase.
+// Every interval between two reads holds the cost of one read, which is taken out.
+long EndcapSearch::runProfiled(long max_points, std::vector<EndcapConfiguration>& config_list) {
+    // The counters count the thread that opened them
+    if (!counters.isOpen() || counters_thread != std::this_thread::get_id()) {
+        counters_thread = std::this_thread::get_id();
+        if (!counters.open()) {
+            profiling = false;
+            return run(max_points, config_list);
+        }
+        profile.setAvailable(counters.getAvailable());
+    }
+
+    PerfCounters::Sample start, before, enumerated, chained, end;
+    counters.read(start);
+    long first_read = counters.getReads();
+    long visited = 0;
+    while (visited < max_points) {
+        bool sample = cycles % PhaseProfile::kSampleInterval == 0;
+        if (sample) counters.read(before);
+        if (!nextPoint()) break;
+        ++visited;
+        ++cycles;
+        if (counting) rejections.countPoint();
+        if (!sample) {
+            exploreRings(config_list);
+            continue;
+        }
+
+        counters.read(enumerated);
+        hr_counts = PerfCounters::Sample{};
+        hr_builds = 0;
+        sampling = true;
+        exploreRings(config_list);
+        sampling = false;
+        counters.read(chained);
+        // The chaining holds the buildRadius calls with their reads and one more read than there are calls
+        PerfCounters::Sample hr = counters.elapsed(PerfCounters::Sample{}, hr_counts, hr_builds);
+        PerfCounters::Sample chaining = counters.elapsed(hr_counts, PerfCounters::difference(enumerated, chained), hr_builds + 1);
+        profile.add(PhaseProfile::Enumeration, counters.elapsed(before, enumerated, 1));
+        profile.add(PhaseProfile::Chaining, chaining);
+        profile.add(PhaseProfile::HrFitting, hr);
+    }
+    counters.read(end);
+    profile.addSearch(counters.elapsed(start, end, counters.getReads() - first_read));
+    return visited;
+}
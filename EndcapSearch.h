@@ -0,0 +1,167 @@
+// EndcapSearch.h
+
+#ifndef ENDCAP_SEARCH_H
+#define ENDCAP_SEARCH_H
+
+#include "EndcapConfiguration.h"
+#include "ParameterLattice.h"
+#include "PerfCounters.h"
+#include "PhaseProfile.h"
+#include "RejectionStats.h"
+#include <string>
+#include <thread>
+#include <vector>
+
+// How the rings between the fixed inner and outer ring are chained
+enum class ChainMethod {
+    Forward,            // outward from ring 0 only
+    Bidirectional,      // outward to a middle ring, inward from the outer ring, joined on the middle ring
+    DynamicProgramming  // reachable states per ring, pruned to those that reach the outer ring
+};
+
+struct SearchOptions {
+    ChainMethod chain_method = ChainMethod::Forward;
+    // Reuse the ring transitions that the innermost lattice loop cannot change
+    bool cache_ring_states = true;
+    // Count the rejected candidates of every constraint; forces the outward search without the ring state cache
+    bool count_rejections = false;
+    // Read the performance counters of the search threads per phase, see PhaseProfile
+    bool profile_phases = false;
+    // Above N_rings: search every ring count from N_rings to max_rings in one pass, outward only
+    int max_rings = 0;
+};
+
+// Iterative search over a range of L lattice points and over the ring chains of each point.
+// The lattice coordinates and the ring choices live on fixed-size stacks, so a search can be
+// stopped after any number of lattice points and resumed later with run().
+// With SearchOptions::max_rings the chains of all ring counts share their prefixes: the walk is a depth-first
+// pass over a trie of chains, where the node of rings 0..k is extended by every ring that can follow it and,
+// for a ring count k+2 in range, closed by the outer ring. Each configuration has its own ring count.
+class EndcapSearch {
+public:
+    static const int kMaxSpecies = ParameterLattice::kMaxSpecies;
+    static const int kMaxRings = 32;
+    static const int kMaxChainStates = 64;
+    // Ring states with npoly up to 8*kCachedNpolySlots-8 are cached
+    static const int kCachedNpolySlots = 128;
+
+    // Search the lattice points with index in [begin, end).
+    EndcapSearch(const EndcapConfiguration& config, const ParameterLattice& lattice, long long begin, long long end,
+                 const SearchOptions& options = SearchOptions());
+
+    // Visit up to max_points lattice points, appending every built configuration to config_list.
+    // Returns the number of points visited; 0 once the search is finished.
+    long run(long max_points, std::vector<EndcapConfiguration>& config_list);
+
+    // Continue with the lattice points of [begin, end); the caches stay valid.
+    void seek(long long begin, long long end);
+
+    bool isDone() const { return done; }
+    long getCycles() const { return cycles; }
+    // Index of the next lattice point to visit
+    long long getPosition() const { return position; }
+    // Outermost ring the forward chaining placed at the last lattice point, N_rings-1 if a chain of any ring count was closed.
+    // Only the forward chaining keeps it up to date.
+    int getDeepestRing() const { return deepest_ring; }
+    // Filled only with SearchOptions::count_rejections
+    const RejectionStats& getRejections() const { return rejections; }
+    // Filled only with SearchOptions::profile_phases
+    const PhaseProfile& getProfile() const { return profile; }
+
+private:
+    bool nextPoint();
+    int nextStates(int ring, int* typenext, int* npolynext);
+    int nextStatesCounted(int ring, double r, int* typenext, int* npolynext);
+    int ringStates(int ring);
+    void build(std::vector<EndcapConfiguration>& config_list) { build(cfg, config_list); }
+    void build(EndcapConfiguration& chain, std::vector<EndcapConfiguration>& config_list);
+    void buildShorter(int ring, int npoly_outer, std::vector<EndcapConfiguration>& config_list);
+    void countHrRejection();
+    long runProfiled(long max_points, std::vector<EndcapConfiguration>& config_list);
+    void exploreRings(std::vector<EndcapConfiguration>& config_list);
+    bool exploreRingsDp(std::vector<EndcapConfiguration>& config_list);
+    bool buildBackwardLayers();
+    int findChainState(int ring, int type, int npoly) const;
+    void joinSuffixes(std::vector<EndcapConfiguration>& config_list);
+    void closeChain(std::vector<EndcapConfiguration>& config_list);
+
+    EndcapConfiguration cfg;
+    const ParameterLattice& lattice;
+    int N_species, N_rings;
+    double step;
+    // Fewest rings searched, N_rings without SearchOptions::max_rings. cfg holds the most rings, the
+    // configurations of min_rings..N_rings-1 rings are built in shorter[n_rings - min_rings].
+    int min_rings;
+    std::vector<EndcapConfiguration> shorter;
+
+    // Lattice stack: integer coordinate of every level, L2[0], L1[1], L2[1], ..., L1[N_species-1]
+    int lattice_k[ParameterLattice::kMaxLevels];
+    long long position, end;
+    bool started = false;
+    bool done = false;
+    long cycles = 0;
+
+    // Ring stack: candidate types and npoly of each ring and the one being explored.
+    // A candidate of type kCloseChain ends the chain with the outer ring at that ring.
+    static const int kCloseChain = -1;
+    int ring_types[kMaxRings][kMaxSpecies + 1];
+    int ring_npolys[kMaxRings][kMaxSpecies + 1];
+    int ring_ntypes[kMaxRings];
+    int ring_next[kMaxRings];
+    int outer_npoly;
+    int deepest_ring = 0;
+
+    // Successors of a ring state among species 0..N_species-2. They depend on the state and on the L1/L2
+    // of those species only, so they stay valid while the innermost lattice loop moves L1[N_species-1].
+    // Slot 0 holds the state of ring 0, slot 1 + type*kCachedNpolySlots + npoly/8 the others.
+    struct StateSuccessors {
+        long long epoch;  // lattice epoch the entry belongs to, 0 if never filled
+        int n;
+        int type[kMaxSpecies];
+        int npoly[kMaxSpecies];
+    };
+    bool cache_ring_states;
+    long long epoch = 0;  // bumped whenever a lattice level other than the innermost changes
+    std::vector<StateSuccessors> successor_cache;
+
+    bool counting = false;
+    RejectionStats rejections;
+
+    // Counters of the thread running the search; sampling while a sampled lattice point is explored,
+    // with the counts of its hr_builds buildRadius calls in hr_counts
+    bool profiling = false;
+    bool sampling = false;
+    PerfCounters counters;
+    std::thread::id counters_thread;
+    PerfCounters::Sample hr_counts;
+    int hr_builds = 0;
+    PhaseProfile profile;
+
+    // Layers of distinct (type, npoly) states per ring with links to the states of the next ring.
+    // The state fixes the radii of the ring, so chains that meet in a state share everything after it.
+    // Bidirectional chaining builds rings join_ring..N_rings-2 inward from the outer ring,
+    // the dynamic programming solver builds every ring outward and marks the live states.
+    struct ChainState {
+        int type, npoly;
+        int n_next;
+        int next[kMaxSpecies];
+        bool live;
+    };
+    bool use_dp = false;
+    int join_ring = 0;
+    bool back_built = false;
+    bool back_ok = false;
+    ChainState chain_layer[kMaxRings][kMaxChainStates];
+    int layer_count[kMaxRings];
+    // Stack of the walk over the links of the layers
+    int suffix_state[kMaxRings];
+    int suffix_pos[kMaxRings];
+};
+
+// Read the search settings that are not part of the geometry; 0 and the reason in error on invalid values.
+int readSearchOptions(TEnv& configfile, SearchOptions& options, std::string& error);
+
+// Types that can follow ring currentRing-1; fills typenext and returns their number.
+int nextCircles(int currentRing, EndcapConfiguration& config, int* typenext);
+
+#endif // ENDCAP_SEARCH_H
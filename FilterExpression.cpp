@@ -0,0 +1,342 @@
+// FilterExpression.C
+
+#include "FilterExpression.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+
+static const char* kDefaultOutputFilter = "abs(npoly[1] - npoly[2]) <= 1";
+
+// Recursive descent over the text, appending postfix code; tracks the stack depth the code needs.
+class FilterExpression::Parser {
+public:
+    Parser(FilterExpression& expression, std::string& error) : e(expression), text(expression.text), error(error) {}
+
+    bool parse() {
+        if (!parseOr()) return false;
+        skipSpace();
+        if (pos < text.size()) return fail("unexpected '" + text.substr(pos, 1) + "'");
+        if (e.code.empty()) return fail("empty expression");
+        return true;
+    }
+
+private:
+    void skipSpace() {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) ++pos;
+    }
+
+    bool accept(const char* token) {
+        skipSpace();
+        std::size_t n = std::char_traits<char>::length(token);
+        if (text.compare(pos, n, token) != 0) return false;
+        // Keep "<", ">" and "!" from matching the start of "<=", ">=" and "!="
+        if (n == 1 && pos + 1 < text.size() && text[pos + 1] == '=' && (token[0] == '<' || token[0] == '>' || token[0] == '!')) return false;
+        pos += n;
+        return true;
+    }
+
+    bool fail(const std::string& message) {
+        error = message + " at column " + std::to_string(pos + 1) + " of \"" + text + "\"";
+        return false;
+    }
+
+    void emit(Op op, double value = 0) {
+        e.code.push_back(Instruction{op, Field::L1, 0, Reduce::Sum, value});
+        // Loads and constants push one value, binary operators pop one, unary ones leave the depth alone
+        if (op == Op::Const || op == Op::Load || op == Op::Aggregate) ++depth;
+        else if (op != Op::Neg && op != Op::Not && op != Op::Abs && op != Op::Sqrt) --depth;
+        max_depth = std::max(max_depth, depth);
+    }
+
+    bool checkDepth() {
+        if (max_depth > kMaxStack) return fail("expression too deeply nested");
+        return true;
+    }
+
+    // Unary operators, parentheses and function calls recurse; the value stack does not bound them
+    bool enter() {
+        if (++nesting > kMaxNesting) return fail("expression nested too deeply");
+        return true;
+    }
+
+    bool parseOr() {
+        if (!parseAnd()) return false;
+        while (accept("||")) {
+            if (!parseAnd()) return false;
+            emit(Op::Or);
+        }
+        return true;
+    }
+
+    bool parseAnd() {
+        if (!parseCompare()) return false;
+        while (accept("&&")) {
+            if (!parseCompare()) return false;
+            emit(Op::And);
+        }
+        return true;
+    }
+
+    bool parseCompare() {
+        if (!parseSum()) return false;
+        static const struct { const char* token; Op op; } kCompares[] = {
+            {"==", Op::Equal}, {"!=", Op::NotEqual}, {"<=", Op::LessEqual}, {">=", Op::GreaterEqual}, {"<", Op::Less}, {">", Op::Greater}};
+        for (auto& compare : kCompares) {
+            if (accept(compare.token)) {
+                if (!parseSum()) return false;
+                emit(compare.op);
+                return true;
+            }
+        }
+        return true;
+    }
+
+    bool parseSum() {
+        if (!parseProduct()) return false;
+        for (;;) {
+            Op op;
+            if (accept("+")) op = Op::Add;
+            else if (accept("-")) op = Op::Sub;
+            else return true;
+            if (!parseProduct()) return false;
+            emit(op);
+        }
+    }
+
+    bool parseProduct() {
+        if (!parseUnary()) return false;
+        for (;;) {
+            Op op;
+            if (accept("*")) op = Op::Mul;
+            else if (accept("/")) op = Op::Div;
+            else return true;
+            if (!parseUnary()) return false;
+            emit(op);
+        }
+    }
+
+    bool parseUnary() {
+        if (accept("-")) {
+            if (!enter() || !parseUnary()) return false;
+            --nesting;
+            emit(Op::Neg);
+            return true;
+        }
+        if (accept("!")) {
+            if (!enter() || !parseUnary()) return false;
+            --nesting;
+            emit(Op::Not);
+            return true;
+        }
+        return parsePrimary();
+    }
+
+    bool readName(std::string& name) {
+        skipSpace();
+        std::size_t start = pos;
+        while (pos < text.size() && (std::isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '_')) ++pos;
+        name = text.substr(start, pos - start);
+        return !name.empty();
+    }
+
+    // Field by name and the number of its elements; false for unknown names
+    bool lookupField(const std::string& name, Field& field, int& size) {
+        static const struct { const char* name; Field field; bool per_ring; } kFields[] = {
+            {"L1", Field::L1, false}, {"L2", Field::L2, false}, {"Hr", Field::Hr, false},
+            {"npoly", Field::Npoly, true}, {"types", Field::Types, true}, {"r_in", Field::RadiusIn, true},
+            {"r_out", Field::RadiusOut, true}, {"height", Field::Height, true}, {"costheta", Field::Costheta, true}};
+        for (auto& entry : kFields) {
+            if (name == entry.name) {
+                field = entry.field;
+                size = entry.per_ring ? e.n_rings : e.n_species;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool parseIndexedField(const std::string& name, Field field, int size) {
+        if (!accept("[")) return fail(name + " needs an index, or use it inside min, max, sum or mean");
+        skipSpace();
+        char* end;
+        long index = std::strtol(text.c_str() + pos, &end, 10);
+        if (end == text.c_str() + pos) return fail("expected an integer index");
+        if (index < 0 || index >= size) return fail(name + " has indices 0 to " + std::to_string(size - 1));
+        pos = end - text.c_str();
+        if (!accept("]")) return fail("expected ']'");
+        emit(Op::Load);
+        e.code.back().field = field;
+        e.code.back().index = static_cast<int>(index);
+        return true;
+    }
+
+    bool parseFunction(const std::string& name) {
+        bool reducible = name == "min" || name == "max" || name == "sum" || name == "mean";
+        if (reducible) {
+            // A bare field name as the only argument reduces over all its elements
+            std::size_t saved = pos;
+            std::string argument;
+            Field field;
+            int size;
+            if (readName(argument) && lookupField(argument, field, size) && accept(")")) {
+                emit(Op::Aggregate);
+                e.code.back().field = field;
+                e.code.back().reduce = name == "min" ? Reduce::Min : name == "max" ? Reduce::Max : name == "sum" ? Reduce::Sum : Reduce::Mean;
+                return true;
+            }
+            pos = saved;
+        }
+        if (name == "abs" || name == "sqrt") {
+            if (!parseOr()) return false;
+            if (!accept(")")) return fail("expected ')'");
+            emit(name == "abs" ? Op::Abs : Op::Sqrt);
+            return true;
+        }
+        if (name == "min" || name == "max") {
+            if (!parseOr()) return false;
+            if (!accept(",")) return fail(name + " takes two values or one field");
+            if (!parseOr()) return false;
+            if (!accept(")")) return fail("expected ')'");
+            emit(name == "min" ? Op::Min : Op::Max);
+            return true;
+        }
+        if (reducible) return fail(name + " takes a field name, e.g. " + name + "(costheta)");
+        return fail("unknown function " + name);
+    }
+
+    bool parsePrimary() {
+        skipSpace();
+        if (pos >= text.size()) return fail("unexpected end");
+        char c = text[pos];
+        if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            char* end;
+            double value = std::strtod(text.c_str() + pos, &end);
+            pos = end - text.c_str();
+            emit(Op::Const, value);
+            return checkDepth();
+        }
+        if (accept("(")) {
+            if (!enter() || !parseOr()) return false;
+            if (!accept(")")) return fail("expected ')'");
+            --nesting;
+            return true;
+        }
+        std::string name;
+        if (!readName(name)) return fail("unexpected '" + text.substr(pos, 1) + "'");
+        if (name == "N_species") {
+            emit(Op::Const, e.n_species);
+            return checkDepth();
+        }
+        if (name == "N_rings") {
+            emit(Op::Load);
+            e.code.back().field = Field::Rings;
+            return checkDepth();
+        }
+        if (accept("(")) {
+            if (!enter() || !parseFunction(name)) return false;
+            --nesting;
+            return checkDepth();
+        }
+        Field field;
+        int size;
+        if (!lookupField(name, field, size)) return fail("unknown name " + name);
+        return parseIndexedField(name, field, size) && checkDepth();
+    }
+
+    FilterExpression& e;
+    const std::string& text;
+    std::string& error;
+    std::size_t pos = 0;
+    int depth = 0, max_depth = 0;
+    int nesting = 0;
+};
+
+int FilterExpression::compile(const std::string& text, int n_species, int n_rings, std::string& error) {
+    this->text = text;
+    this->n_species = n_species;
+    this->n_rings = n_rings;
+    code.clear();
+    Parser parser(*this, error);
+    if (!parser.parse()) {
+        code.clear();
+        return 0;
+    }
+    return 1;
+}
+
+double FilterExpression::load(const EndcapConfiguration& cfg, Field field, int index) {
+    switch (field) {
+        case Field::L1: return cfg.getL1()[index];
+        case Field::L2: return cfg.getL2()[index];
+        case Field::Hr: return cfg.getHr()[index];
+        case Field::Npoly: return cfg.getNpoly()[index];
+        case Field::Types: return cfg.getTypes()[index];
+        case Field::RadiusIn: return cfg.getRadius()[index][0];
+        case Field::RadiusOut: return cfg.getRadius()[index][1];
+        case Field::Height: return cfg.getRadius()[index][1] - cfg.getRadius()[index][0];
+        case Field::Costheta:
+            return (cfg.getRadius()[index][1] - cfg.getRadius()[index][0]) / cfg.getHr()[cfg.getTypes()[index]];
+        case Field::Rings: return cfg.getNRings();
+    }
+    return 0;
+}
+
+double FilterExpression::evaluate(const EndcapConfiguration& cfg) const {
+    double stack[kMaxStack];
+    int top = 0;
+    for (auto& in : code) {
+        switch (in.op) {
+            case Op::Const: stack[top++] = in.value; break;
+            case Op::Load: stack[top++] = load(cfg, in.field, in.index); break;
+            case Op::Aggregate: {
+                bool per_species = in.field == Field::L1 || in.field == Field::L2 || in.field == Field::Hr;
+                int n = per_species ? n_species : cfg.getNRings();
+                double result = load(cfg, in.field, 0);
+                for (int i = 1; i < n; ++i) {
+                    double value = load(cfg, in.field, i);
+                    if (in.reduce == Reduce::Min) result = std::min(result, value);
+                    else if (in.reduce == Reduce::Max) result = std::max(result, value);
+                    else result += value;
+                }
+                stack[top++] = in.reduce == Reduce::Mean ? result / n : result;
+                break;
+            }
+            case Op::Neg: stack[top - 1] = -stack[top - 1]; break;
+            case Op::Not: stack[top - 1] = stack[top - 1] == 0; break;
+            case Op::Abs: stack[top - 1] = std::fabs(stack[top - 1]); break;
+            case Op::Sqrt: stack[top - 1] = std::sqrt(stack[top - 1]); break;
+            default: {
+                double b = stack[--top];
+                double& a = stack[top - 1];
+                switch (in.op) {
+                    case Op::Add: a = a + b; break;
+                    case Op::Sub: a = a - b; break;
+                    case Op::Mul: a = a * b; break;
+                    case Op::Div: a = a / b; break;
+                    case Op::Less: a = a < b; break;
+                    case Op::LessEqual: a = a <= b; break;
+                    case Op::Greater: a = a > b; break;
+                    case Op::GreaterEqual: a = a >= b; break;
+                    case Op::Equal: a = a == b; break;
+                    case Op::NotEqual: a = a != b; break;
+                    case Op::And: a = a != 0 && b != 0; break;
+                    case Op::Or: a = a != 0 || b != 0; break;
+                    case Op::Min: a = std::min(a, b); break;
+                    case Op::Max: a = std::max(a, b); break;
+                    default: break;
+                }
+            }
+        }
+    }
+    return stack[0];
+}
+
+int readOutputFilter(TEnv& configfile, const EndcapConfiguration& config, FilterExpression& filter, std::string& error) {
+    std::string text = configfile.GetValue("Output_filter", kDefaultOutputFilter);
+    if (!filter.compile(text, config.getNspecies(), config.getNRings(), error)) {
+        error = "Output_filter: " + error;
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,62 @@
+// FilterExpression.h
+
+#ifndef FILTER_EXPRESSION_H
+#define FILTER_EXPRESSION_H
+
+#include "EndcapConfiguration.h"
+#include <TEnv.h>
+#include <string>
+#include <vector>
+
+// Output filters and scores written in the ini file, e.g.
+//   Output_filter: abs(npoly[1] - npoly[2]) <= 1 && min(costheta) > 0.99
+//   Score: mean(costheta) - 0.001 * abs(Hr[0] - Hr[1])
+// Per species: L1[i], L2[i], Hr[i]. Per ring: npoly[i], types[i], r_in[i], r_out[i], height[i] (r_out - r_in),
+// costheta[i] (height over the sensor height). N_species is a constant, N_rings the ring count of the configuration,
+// which differs between results when the search covers several ring counts (N_rings_max).
+// Operators, loosest binding first: || && , == != < <= > >= , + - , * / , unary - and !. True is 1, false 0.
+// Functions: abs, sqrt, min(a, b), max(a, b), and min, max, sum, mean of a whole field, e.g. min(costheta).
+// Indices are integer constants, checked against N_species and the fewest rings when compiling. Whole-field
+// functions of the per-ring fields cover the rings of the configuration.
+// compile() turns the text into postfix code for a small stack machine; evaluate() only reads the
+// configuration, so one compiled expression can be used from all search threads.
+class FilterExpression {
+public:
+    // Compile text for configurations of n_species species and n_rings rings; 0 and a message in error otherwise.
+    int compile(const std::string& text, int n_species, int n_rings, std::string& error);
+
+    double evaluate(const EndcapConfiguration& cfg) const;
+    bool accepts(const EndcapConfiguration& cfg) const { return evaluate(cfg) != 0; }
+    const std::string& getText() const { return text; }
+
+    static const int kMaxStack = 64;
+    // Unary operators, parentheses and function calls nested in one another
+    static const int kMaxNesting = 256;
+
+private:
+    enum class Op { Const, Load, Aggregate, Neg, Not, Add, Sub, Mul, Div, Less, LessEqual, Greater, GreaterEqual,
+                    Equal, NotEqual, And, Or, Abs, Sqrt, Min, Max };
+    enum class Field { L1, L2, Hr, Npoly, Types, RadiusIn, RadiusOut, Height, Costheta, Rings };
+    enum class Reduce { Min, Max, Sum, Mean };
+
+    struct Instruction {
+        Op op;
+        Field field;
+        int index;
+        Reduce reduce;
+        double value;
+    };
+
+    class Parser;
+
+    static double load(const EndcapConfiguration& cfg, Field field, int index);
+
+    std::string text;
+    int n_species = 0, n_rings = 0;
+    std::vector<Instruction> code;
+};
+
+// Compile Output_filter of the ini file, by default the filter of runOptimization: abs(npoly[1] - npoly[2]) <= 1
+int readOutputFilter(TEnv& configfile, const EndcapConfiguration& config, FilterExpression& filter, std::string& error);
+
+#endif // FILTER_EXPRESSION_H
@@ -0,0 +1,315 @@
+// JobServer.C
+
+#include "JobServer.h"
+#include "EndcapConfiguration.h"
+#include "EndcapSearch.h"
+#include "FilterExpression.h"
+#include <TEnv.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+static void skipSpace(const std::string& s, std::size_t& i) {
+    while (i < s.size() && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' || s[i] == '\n')) ++i;
+}
+
+// JSON string starting at s[i]; \uXXXX escapes are only accepted for ASCII.
+static bool readString(const std::string& s, std::size_t& i, std::string& out) {
+    if (i >= s.size() || s[i] != '"') return false;
+    out.clear();
+    for (++i; i < s.size(); ++i) {
+        char c = s[i];
+        if (c == '"') {
+            ++i;
+            return true;
+        }
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+        if (++i >= s.size()) return false;
+        switch (s[i]) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u': {
+                if (i + 4 >= s.size()) return false;
+                std::string hex = s.substr(i + 1, 4);
+                char* end;
+                long code = std::strtol(hex.c_str(), &end, 16);
+                if (*end != '\0' || code > 0x7f) return false;
+                out += static_cast<char>(code);
+                i += 4;
+                break;
+            }
+            default: out += s[i]; break;  // \" \\ \/
+        }
+    }
+    return false;
+}
+
+// String, or a bare number / true / false / null token, as text
+static bool readScalar(const std::string& s, std::size_t& i, std::string& out) {
+    if (i < s.size() && s[i] == '"') return readString(s, i, out);
+    std::size_t start = i;
+    while (i < s.size() && s[i] != ',' && s[i] != ']' && s[i] != '}' && s[i] != ' ' && s[i] != '\t') ++i;
+    out = s.substr(start, i - start);
+    return !out.empty();
+}
+
+// Scalar, or an array of scalars joined with spaces like the list keys of the ini file
+static bool readValue(const std::string& s, std::size_t& i, std::string& out) {
+    if (i >= s.size() || s[i] != '[') return readScalar(s, i, out);
+    out.clear();
+    ++i;
+    skipSpace(s, i);
+    if (i < s.size() && s[i] == ']') {
+        ++i;
+        return true;
+    }
+    for (;;) {
+        std::string item;
+        skipSpace(s, i);
+        if (!readScalar(s, i, item)) return false;
+        out += out.empty() ? item : " " + item;
+        skipSpace(s, i);
+        if (i < s.size() && s[i] == ',') {
+            ++i;
+            continue;
+        }
+        if (i < s.size() && s[i] == ']') {
+            ++i;
+            return true;
+        }
+        return false;
+    }
+}
+
+// Fields of a flat JSON object; false with a message if the line is not one
+static bool parseJob(const std::string& line, std::vector<std::pair<std::string, std::string>>& fields, std::string& error) {
+    std::size_t i = 0;
+    skipSpace(line, i);
+    if (i >= line.size() || line[i] != '{') {
+        error = "a job must be a JSON object";
+        return false;
+    }
+    ++i;
+    skipSpace(line, i);
+    if (i < line.size() && line[i] == '}') return true;
+
+    for (;;) {
+        std::string key, value;
+        skipSpace(line, i);
+        if (!readString(line, i, key)) {
+            error = "expected a quoted key";
+            return false;
+        }
+        skipSpace(line, i);
+        if (i >= line.size() || line[i] != ':') {
+            error = "expected ':' after key " + key;
+            return false;
+        }
+        ++i;
+        skipSpace(line, i);
+        if (!readValue(line, i, value)) {
+            error = "invalid value for key " + key;
+            return false;
+        }
+        fields.emplace_back(key, value);
+        skipSpace(line, i);
+        if (i < line.size() && line[i] == ',') {
+            ++i;
+            continue;
+        }
+        if (i < line.size() && line[i] == '}') return true;
+        error = "expected ',' or '}' after key " + key;
+        return false;
+    }
+}
+
+static std::string jsonString(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+template <typename T>
+static void writeArray(FILE* out, const char* name, const std::vector<T>& values, const char* format) {
+    fprintf(out, "\"%s\":[", name);
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        if (i > 0) fputc(',', out);
+        fprintf(out, format, values[i]);
+    }
+    fputc(']', out);
+}
+
+static void writeResult(FILE* out, const std::string& id, const EndcapConfiguration& cfg) {
+    fprintf(out, "{\"id\":%s,\"result\":{", id.c_str());
+    writeArray(out, "L1", cfg.getL1(), "%.4f");
+    fputc(',', out);
+    writeArray(out, "L2", cfg.getL2(), "%.4f");
+    fputc(',', out);
+    writeArray(out, "npoly", cfg.getNpoly(), "%d");
+    fputc(',', out);
+    writeArray(out, "types", cfg.getTypes(), "%d");
+    fputc(',', out);
+    writeArray(out, "Hr", cfg.getHr(), "%.4f");
+    fprintf(out, ",\"radius\":[");
+    auto& radius = cfg.getRadius();
+    for (std::size_t i = 0; i < radius.size(); ++i) {
+        fprintf(out, "%s[%.4f,%.4f]", i > 0 ? "," : "", radius[i][0], radius[i][1]);
+    }
+    fprintf(out, "]}}\n");
+}
+
+static void writeError(FILE* out, const std::string& id, const std::string& message) {
+    fprintf(out, "{\"id\":%s,\"status\":\"error\",\"message\":%s}\n", id.c_str(), jsonString(message).c_str());
+}
+
+JobServer::JobServer(const TString& base_ini, ThreadPool& pool) : base_ini(base_ini), pool(pool) {}
+
+void JobServer::runJob(const std::string& line, long line_number, FILE* out) {
+    std::vector<std::pair<std::string, std::string>> fields;
+    std::string error;
+    std::string id = std::to_string(line_number);
+    if (!parseJob(line, fields, error)) {
+        writeError(out, id, error);
+        return;
+    }
+
+    // The base file is read again for every job so overrides never leak into the next one
+    TEnv configfile(base_ini);
+    for (auto& field : fields) {
+        if (field.first == "id") {
+            id = jsonString(field.second);
+        } else {
+            configfile.SetValue(field.first.c_str(), field.second.c_str());
+        }
+    }
+
+    if (TString(configfile.GetValue("Disk_radii", "")).Length() > 0) {
+        writeError(out, id, "multi-disk jobs are not supported in server mode");
+        return;
+    }
+    // Checked before the configuration is built, which sizes its vectors by them and writes the outer ring
+    int n_species = configfile.GetValue("N_species", 3);
+    int n_rings = configfile.GetValue("N_rings", 3);
+    if (n_species < 3 || n_species > ParameterLattice::kMaxSpecies || n_rings < 2 || n_rings > EndcapSearch::kMaxRings) {
+        writeError(out, id, "N_species must be in [3, " + std::to_string(ParameterLattice::kMaxSpecies) +
+                            "] and N_rings in [2, " + std::to_string(EndcapSearch::kMaxRings) + "]");
+        return;
+    }
+    EndcapConfiguration config(configfile);
+    SearchOptions options;
+    if (!readSearchOptions(configfile, options, error)) {
+        writeError(out, id, error);
+        return;
+    }
+    int shard_count = configfile.GetValue("Shard_count", 1);
+    int shard_index = configfile.GetValue("Shard_index", 0);
+    if (shard_count < 1 || shard_index < 0 || shard_index >= shard_count) {
+        writeError(out, id, "Shard_index must be in [0, Shard_count)");
+        return;
+    }
+    double step_length = configfile.GetValue("step_length", 0.5);
+    if (step_length <= 0) {
+        writeError(out, id, "step_length must be positive");
+        return;
+    }
+    long max_results = configfile.GetValue("Max_results", 0);
+    FilterExpression filter;
+    if (!readOutputFilter(configfile, config, filter, error)) {
+        writeError(out, id, error);
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    EndcapOptimizer optimizer(config, step_length, options);
+    optimizer.setShard(shard_index, shard_count);
+    optimizer.setFilter([&filter](EndcapConfiguration& cfg) { return filter.accepts(cfg); });
+    optimizer.run(pool, [&](EndcapConfiguration& cfg) {
+        writeResult(out, id, cfg);
+        if (max_results > 0 && optimizer.getResults() + 1 >= max_results) optimizer.cancel();
+    });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    fprintf(out, "{\"id\":%s,\"status\":\"done\",\"lattice_points\":%lld,\"searched\":[%lld,%lld],\"cycles\":%lld,\"results\":%ld,\"seconds\":%.3f}\n",
+            id.c_str(), optimizer.getLatticeSize(), optimizer.getBegin(), optimizer.getEnd(), optimizer.getPointsDone(),
+            optimizer.getResults(), seconds);
+}
+
+long JobServer::serveStream(FILE* in, FILE* out) {
+    long line_number = 0, jobs = 0;
+    std::string line;
+    char buffer[4096];
+    while (fgets(buffer, sizeof(buffer), in)) {
+        line += buffer;
+        if (line.back() != '\n' && !feof(in)) continue;  // longer than the buffer
+        ++line_number;
+
+        std::size_t first = line.find_first_not_of(" \t\r\n");
+        if (first != std::string::npos && line[first] != '#') {
+            runJob(line, line_number, out);
+            fflush(out);
+            ++jobs;
+        }
+        line.clear();
+    }
+    return jobs;
+}
+
+int JobServer::serveSocket(const char* path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (std::string(path).size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: socket path too long: " << path << std::endl;
+        return 0;
+    }
+    std::snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (server < 0 || bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(server, 8) < 0) {
+        std::cerr << "Error: cannot listen on " << path << std::endl;
+        if (server >= 0) close(server);
+        return 0;
+    }
+    printf("Serving jobs on %s\n", path);
+    fflush(stdout);
+
+    for (;;) {
+        int connection = accept(server, nullptr, nullptr);
+        if (connection < 0) {
+            std::cerr << "Error: accept failed on " << path << std::endl;
+            break;
+        }
+        FILE* in = fdopen(connection, "r");
+        FILE* out = fdopen(dup(connection), "w");
+        if (in && out) serveStream(in, out);
+        if (out) fclose(out);
+        if (in) fclose(in);
+    }
+    close(server);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,35 @@
+// JobServer.h
+
+#ifndef JOB_SERVER_H
+#define JOB_SERVER_H
+
+#include "EndcapOptimizer.h"
+#include "ThreadPool.h"
+#include <TString.h>
+#include <cstdio>
+#include <string>
+
+// Server mode: runs a stream of optimization jobs on one long-lived thread pool.
+// A job is one line holding a flat JSON object of ini keys that override the base ini file, e.g.
+//   {"id": "a1", "step_length": 0.5, "N_rings": 4, "Max_results": 10}
+// Array values are joined with spaces. "id" tags the replies, the line number is used without it.
+// Every job is filtered by its own Output_filter, see FilterExpression.
+// Replies are JSON lines too: one {"id":..., "result": {...}} per configuration passing the filter,
+// then {"id":..., "status": "done", ...} or {"id":..., "status": "error", "message": ...}.
+class JobServer {
+public:
+    JobServer(const TString& base_ini, ThreadPool& pool);
+
+    // Serve every job line of in, writing the replies to out. Returns the number of jobs read.
+    long serveStream(FILE* in, FILE* out);
+    // Accept connections on a Unix socket at path and serve them one after the other; returns only on errors.
+    int serveSocket(const char* path);
+
+private:
+    void runJob(const std::string& line, long line_number, FILE* out);
+
+    TString base_ini;
+    ThreadPool& pool;
+};
+
+#endif // JOB_SERVER_H
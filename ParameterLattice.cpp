@@ -0,0 +1,144 @@
+// ParameterLattice.C
+
+#include "ParameterLattice.h"
+#include <TMath.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+// Number of k >= k_min with base + k*step <= bound, using the same expression as value().
+static int countSteps(double base, int k_min, double step, double bound) {
+    int k = static_cast<int>(std::floor((bound - base) / step));
+    while (base + (k + 1) * step <= bound) ++k;
+    while (k >= k_min && base + k * step > bound) --k;
+    return std::max(k - k_min + 1, 0);
+}
+
+ParameterLattice::ParameterLattice(const EndcapConfiguration& config, double step_length)
+    : step(step_length) {
+    N_species = config.getNspecies();
+    n_levels = 2 * (N_species - 1);
+    L_min = config.getLMin();
+    L_max = config.getLMax();
+    L2_last = config.getL2()[N_species - 1];
+    total = 0;
+
+    if (N_species < 2 || N_species > kMaxSpecies || step <= 0) {
+        std::cerr << "Error: the L lattice needs 2 to " << kMaxSpecies << " species and a positive step." << std::endl;
+        n_levels = 0;
+        return;
+    }
+
+    n_L1.assign(N_species, 0);
+    below_prefix.assign(N_species, std::vector<long long>());
+    below_L2.assign(N_species + 1, 1);
+
+    // Count from the innermost species outwards
+    for (int d = N_species - 1; d >= 1; --d) {
+        double bound = (d == N_species - 1) ? L2_last - step : L_max;
+        n_L1[d] = countSteps(L_min, 0, step, bound);
+
+        auto& prefix = below_prefix[d];
+        prefix.assign(n_L1[d] + 1, 0);
+        for (int k = 0; k < n_L1[d]; ++k) {
+            long long below = 1;
+            if (d < N_species - 1) {
+                below = countL2(TMath::Nint(L_min + k * step)) * below_L2[d + 1];
+            }
+            prefix[k + 1] = prefix[k] + below;
+        }
+        below_L2[d] = prefix.back();
+    }
+
+    total = countL2(TMath::Nint(config.getL1()[0])) * below_L2[1];
+}
+
+int ParameterLattice::countL2(int round_l1) const {
+    return countSteps(round_l1, 1, step, L_max);
+}
+
+double ParameterLattice::value(int level, int k, const EndcapConfiguration& config) const {
+    int depth = level / 2 + 1;
+    if (level % 2 == 0) {
+        return TMath::Nint(config.getL1()[depth - 1]) + k * step;
+    }
+    return L_min + k * step;
+}
+
+int ParameterLattice::upperBound(int level, const EndcapConfiguration& config) const {
+    int depth = level / 2 + 1;
+    if (level % 2 == 0) {
+        return countL2(TMath::Nint(config.getL1()[depth - 1]));
+    }
+    return n_L1[depth] - 1;
+}
+
+double* ParameterLattice::variable(int level, EndcapConfiguration& config) const {
+    int depth = level / 2 + 1;
+    if (level % 2 == 0) return &config.getL2()[depth - 1];
+    return &config.getL1()[depth];
+}
+
+void ParameterLattice::decode(long long index, EndcapConfiguration& config, int* k) const {
+    auto& L1 = config.getL1();
+    auto& L2 = config.getL2();
+
+    for (int d = 1; d < N_species; ++d) {
+        // L2[d-1]: each choice covers below_L2[d] points
+        long long j = index / below_L2[d];
+        index %= below_L2[d];
+        k[2 * (d - 1)] = static_cast<int>(j) + 1;
+        L2[d - 1] = value(2 * (d - 1), k[2 * (d - 1)], config);
+
+        // L1[d]: last coordinate whose prefix does not exceed the remainder
+        auto& prefix = below_prefix[d];
+        int k1 = static_cast<int>(std::upper_bound(prefix.begin(), prefix.end(), index) - prefix.begin()) - 1;
+        index -= prefix[k1];
+        k[2 * d - 1] = k1;
+        L1[d] = value(2 * d - 1, k1, config);
+    }
+}
+
+long long ParameterLattice::encode(EndcapConfiguration& config, int* k) const {
+    long long index = 0;
+    for (int level = 0; level < n_levels; ++level) {
+        int lo = lowerBound(level);
+        int hi = upperBound(level, config);
+        if (hi < lo) return -1;
+        k[level] = std::min(std::max(k[level], lo), hi);
+        *variable(level, config) = value(level, k[level], config);
+
+        int d = level / 2 + 1;
+        if (level % 2 == 0) {
+            index += (k[level] - 1) * below_L2[d];
+        } else {
+            // An L1 with no L2 choices below it has no points
+            if (below_prefix[d][k[level] + 1] == below_prefix[d][k[level]]) return -1;
+            index += below_prefix[d][k[level]];
+        }
+    }
+    return index;
+}
+
+// advance() once the innermost level is exhausted
+int ParameterLattice::carry(EndcapConfiguration& config, int* k) const {
+    int level = n_levels - 1;
+    int changed = level;
+    ++k[level];
+
+    for (;;) {
+        if (k[level] > upperBound(level, config)) {
+            // Carry into the next outer level
+            if (level == 0) return -1;
+            --level;
+            ++k[level];
+            changed = std::min(changed, level);
+            continue;
+        }
+        *variable(level, config) = value(level, k[level], config);
+        if (level == n_levels - 1) return changed;
+
+        ++level;
+        k[level] = lowerBound(level);
+    }
+}
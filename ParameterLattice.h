@@ -0,0 +1,66 @@
+// ParameterLattice.h
+
+#ifndef PARAMETER_LATTICE_H
+#define PARAMETER_LATTICE_H
+
+#include "EndcapConfiguration.h"
+#include <vector>
+
+// Integer lattice of the free L1/L2 side lengths.
+// The variables are ordered like the nested loops: L2[0], L1[1], L2[1], ..., L2[N_species-2], L1[N_species-1].
+// Level 2*(d-1) holds L2[d-1] = Round(L1[d-1]) + k*step with k >= 1 and L2 <= L_max,
+// level 2*d-1 holds L1[d] = L_min + k*step with L1 <= L_max, or L1 <= L2[d] - step for the last species.
+// Every point has a stable index in [0, size()) following the loop order, and can be decoded from it directly.
+class ParameterLattice {
+public:
+    static const int kMaxSpecies = 8;
+    static const int kMaxLevels = 2 * (kMaxSpecies - 1);
+
+    ParameterLattice(const EndcapConfiguration& config, double step_length);
+
+    long long size() const { return total; }
+    int getNLevels() const { return n_levels; }
+    double getStep() const { return step; }
+
+    // Side length at level for lattice coordinate k, in mm.
+    double value(int level, int k, const EndcapConfiguration& config) const;
+    // Coordinate range of a level given the values of the outer levels already in config.
+    int lowerBound(int level) const { return level % 2 == 0 ? 1 : 0; }
+    int upperBound(int level, const EndcapConfiguration& config) const;
+
+    // Set the point with the given index into config, and its coordinates into k.
+    void decode(long long index, EndcapConfiguration& config, int* k) const;
+    // Clamp the coordinates k level by level into the ranges the outer levels allow, set the point into
+    // config and return its index; -1 if some level has no valid coordinate.
+    long long encode(EndcapConfiguration& config, int* k) const;
+    // Move config and k to the next point in index order.
+    // Returns the outermost level that changed, or -1 after the last point.
+    int advance(EndcapConfiguration& config, int* k) const {
+        // Fast path: only the innermost L1 moves
+        int level = n_levels - 1;
+        if (k[level] < n_L1[N_species - 1] - 1) {
+            ++k[level];
+            config.getL1()[N_species - 1] = L_min + k[level] * step;
+            return level;
+        }
+        return carry(config, k);
+    }
+
+private:
+    int carry(EndcapConfiguration& config, int* k) const;
+    double* variable(int level, EndcapConfiguration& config) const;
+    int countL2(int round_l1) const;
+
+    int N_species, n_levels;
+    double step, L_min, L_max;
+    double L2_last;
+    long long total;
+
+    // For species d >= 1: number of L1 coordinates, and prefix sums of the points below each of them
+    std::vector<int> n_L1;
+    std::vector<std::vector<long long>> below_prefix;
+    // Number of points below one choice of L2[d-1], i.e. below_prefix[d].back()
+    std::vector<long long> below_L2;
+};
+
+#endif // PARAMETER_LATTICE_H
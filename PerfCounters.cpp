@@ -0,0 +1,116 @@
+// PerfCounters.C
+
+#include "PerfCounters.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static std::atomic<bool> warned(false);
+// Reads timed back to back to find the cost of one
+static const int kCalibrationReads = 33;
+
+static int openEvent(uint32_t type, uint64_t config, int group) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+}
+
+PerfCounters::~PerfCounters() {
+    close();
+}
+
+void PerfCounters::close() {
+    for (int event = kEvents - 1; event >= 0; --event) {
+        if (fds[event] >= 0) ::close(fds[event]);
+        fds[event] = -1;
+        slots[event] = -1;
+    }
+    n_open = 0;
+    available = 0;
+    read_cost = Sample{};
+}
+
+bool PerfCounters::open() {
+    close();
+    static const struct { uint32_t type; uint64_t config; } kEventTypes[kEvents] = {
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}};
+
+    for (int event = 0; event < kEvents; ++event) {
+        int fd = openEvent(kEventTypes[event].type, kEventTypes[event].config, event == TaskClock ? -1 : fds[TaskClock]);
+        if (fd < 0) {
+            if (event == TaskClock) {
+                if (!warned.exchange(true)) {
+                    std::cerr << "Warning: no performance counters, perf_event_open: " << std::strerror(errno) << std::endl;
+                }
+                return false;
+            }
+            continue;
+        }
+        fds[event] = fd;
+        slots[event] = n_open++;
+        available |= 1u << event;
+    }
+    if (available != (1u << kEvents) - 1 && !warned.exchange(true)) {
+        std::cerr << "Warning: only some performance counters are available:";
+        for (int event = 0; event < kEvents; ++event) {
+            if (available & (1u << event)) std::cerr << " " << eventName(static_cast<Event>(event));
+        }
+        std::cerr << std::endl;
+    }
+
+    Sample samples[kCalibrationReads];
+    for (auto& sample : samples) read(sample);
+    for (int event = 0; event < kEvents; ++event) {
+        uint64_t costs[kCalibrationReads - 1];
+        for (int i = 1; i < kCalibrationReads; ++i) costs[i - 1] = samples[i].value[event] - samples[i - 1].value[event];
+        std::nth_element(costs, costs + kCalibrationReads / 2, costs + kCalibrationReads - 1);
+        read_cost.value[event] = costs[kCalibrationReads / 2];
+    }
+    return true;
+}
+
+void PerfCounters::read(Sample& sample) const {
+    // Group read: the number of events, then their values in the order they were opened
+    ++n_reads;
+    uint64_t buffer[1 + kEvents] = {};
+    if (isOpen() && ::read(fds[TaskClock], buffer, sizeof(buffer)) < static_cast<ssize_t>(sizeof(uint64_t))) buffer[0] = 0;
+    for (int event = 0; event < kEvents; ++event) {
+        sample.value[event] = slots[event] >= 0 && slots[event] < static_cast<int>(buffer[0]) ? buffer[1 + slots[event]] : 0;
+    }
+}
+
+PerfCounters::Sample PerfCounters::elapsed(const Sample& from, const Sample& to, long n_reads) const {
+    Sample delta;
+    for (int event = 0; event < kEvents; ++event) {
+        uint64_t count = to.value[event] - from.value[event];
+        uint64_t cost = n_reads * read_cost.value[event];
+        delta.value[event] = count > cost ? count - cost : 0;
+    }
+    return delta;
+}
+
+PerfCounters::Sample PerfCounters::difference(const Sample& from, const Sample& to) {
+    Sample delta;
+    for (int event = 0; event < kEvents; ++event) delta.value[event] = to.value[event] - from.value[event];
+    return delta;
+}
+
+const char* PerfCounters::eventName(Event event) {
+    static const char* kNames[kEvents] = {"task-clock", "cycles", "instructions", "branch-misses", "cache-misses"};
+    return kNames[event];
+}
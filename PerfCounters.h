@@ -0,0 +1,55 @@
+// PerfCounters.h
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+
+// Linux performance counters of the calling thread, user space only, read together as one perf_event_open group.
+// The task clock leads the group and works everywhere; the hardware events are added where the CPU and the
+// kernel offer them (not in most virtual machines) and read 0 otherwise, see getAvailable().
+class PerfCounters {
+public:
+    enum Event { TaskClock, Cycles, Instructions, BranchMisses, CacheMisses, kEvents };
+
+    struct Sample {
+        uint64_t value[kEvents];
+    };
+
+    PerfCounters() = default;
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Open the counters on the calling thread; false if even the task clock cannot be counted.
+    // The first failure of the process prints a warning.
+    bool open();
+    bool isOpen() const { return fds[TaskClock] >= 0; }
+    // Bit 1 << event for every event that is counted
+    unsigned getAvailable() const { return available; }
+
+    void read(Sample& sample) const;
+    // Number of read() calls so far
+    long getReads() const { return n_reads; }
+
+    // Counts between two reads with n_reads read() calls in between (the second one included) taken out:
+    // every read costs some instructions in user space and, for the task clock, the time of the system call.
+    Sample elapsed(const Sample& from, const Sample& to, long n_reads) const;
+    static Sample difference(const Sample& from, const Sample& to);
+    static const char* eventName(Event event);
+
+private:
+    void close();
+
+    int fds[kEvents] = {-1, -1, -1, -1, -1};
+    // Position of every event in a group read, -1 if not counted
+    int slots[kEvents] = {-1, -1, -1, -1, -1};
+    int n_open = 0;
+    unsigned available = 0;
+    mutable long n_reads = 0;
+    // Median counts of one read(), measured by open()
+    Sample read_cost = {};
+};
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,103 @@
+// PhaseProfile.C
+
+#include "PhaseProfile.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+static std::atomic<int> n_threads(0);
+static thread_local int thread_number = -1;
+
+static void addCounts(PerfCounters::Sample& sum, const PerfCounters::Sample& counts) {
+    for (int event = 0; event < PerfCounters::kEvents; ++event) sum.value[event] += counts.value[event];
+}
+
+PhaseProfile::ThreadCounts& PhaseProfile::current() {
+    if (thread_number < 0) thread_number = n_threads++;
+    if (static_cast<int>(threads.size()) <= thread_number) {
+        ThreadCounts zero;
+        std::memset(&zero, 0, sizeof(zero));
+        threads.resize(thread_number + 1, zero);
+    }
+    return threads[thread_number];
+}
+
+void PhaseProfile::add(Phase phase, const PerfCounters::Sample& counts) {
+    addCounts(current().phases[phase], counts);
+}
+
+void PhaseProfile::addSearch(const PerfCounters::Sample& counts) {
+    addCounts(current().search, counts);
+}
+
+void PhaseProfile::merge(const PhaseProfile& other) {
+    available |= other.available;
+    if (threads.size() < other.threads.size()) {
+        ThreadCounts zero;
+        std::memset(&zero, 0, sizeof(zero));
+        threads.resize(other.threads.size(), zero);
+    }
+    for (std::size_t thread = 0; thread < other.threads.size(); ++thread) {
+        addCounts(threads[thread].search, other.threads[thread].search);
+        for (int phase = 0; phase < kPhases; ++phase) addCounts(threads[thread].phases[phase], other.threads[thread].phases[phase]);
+    }
+}
+
+void PhaseProfile::estimate(const ThreadCounts& counts, PerfCounters::Sample* phases) const {
+    for (int event = 0; event < PerfCounters::kEvents; ++event) {
+        double sampled = 0;
+        for (int phase = Enumeration; phase < Merging; ++phase) sampled += counts.phases[phase].value[event];
+        for (int phase = Enumeration; phase < Merging; ++phase) {
+            phases[phase].value[event] = sampled > 0 ? static_cast<uint64_t>(counts.search.value[event] * (counts.phases[phase].value[event] / sampled)) : 0;
+        }
+        phases[Merging].value[event] = counts.phases[Merging].value[event];
+    }
+}
+
+// One row: task clock in ms, the hardware events, and instructions per cycle
+static void printRow(const char* label, const PerfCounters::Sample& counts, unsigned available) {
+    printf("%-12s %12.1f", label, counts.value[PerfCounters::TaskClock] / 1e6);
+    for (int event = PerfCounters::Cycles; event < PerfCounters::kEvents; ++event) {
+        if (available & (1u << event)) printf(" %15llu", static_cast<unsigned long long>(counts.value[event]));
+        else printf(" %15s", "n/a");
+    }
+    unsigned ipc_events = (1u << PerfCounters::Cycles) | (1u << PerfCounters::Instructions);
+    if ((available & ipc_events) == ipc_events && counts.value[PerfCounters::Cycles] > 0) {
+        printf(" %6.2f\n", static_cast<double>(counts.value[PerfCounters::Instructions]) / counts.value[PerfCounters::Cycles]);
+    } else {
+        printf(" %6s\n", "n/a");
+    }
+}
+
+void PhaseProfile::print() const {
+    static const char* kPhaseNames[kPhases] = {"enumeration", "chaining", "Hr fitting", "merging"};
+    if (threads.empty()) {
+        printf("Performance counters: none counted\n");
+        return;
+    }
+    printf("Performance counters in user space, search phases split as measured on every %dth lattice point:\n", kSampleInterval);
+    printf("%-12s %12s", "", "task ms");
+    for (int event = PerfCounters::Cycles; event < PerfCounters::kEvents; ++event) {
+        printf(" %15s", PerfCounters::eventName(static_cast<PerfCounters::Event>(event)));
+    }
+    printf(" %6s\n", "IPC");
+
+    PerfCounters::Sample totals[kPhases];
+    std::memset(totals, 0, sizeof(totals));
+    std::vector<PerfCounters::Sample> per_thread(threads.size());
+    for (std::size_t thread = 0; thread < threads.size(); ++thread) {
+        PerfCounters::Sample phases[kPhases];
+        estimate(threads[thread], phases);
+        std::memset(&per_thread[thread], 0, sizeof(per_thread[thread]));
+        for (int phase = 0; phase < kPhases; ++phase) {
+            addCounts(totals[phase], phases[phase]);
+            addCounts(per_thread[thread], phases[phase]);
+        }
+    }
+    for (int phase = 0; phase < kPhases; ++phase) printRow(kPhaseNames[phase], totals[phase], available);
+    for (std::size_t thread = 0; thread < threads.size(); ++thread) {
+        char label[32];
+        snprintf(label, sizeof(label), "thread %zu", thread + 1);
+        printRow(label, per_thread[thread], available);
+    }
+}
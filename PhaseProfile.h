@@ -0,0 +1,48 @@
+// PhaseProfile.h
+
+#ifndef PHASE_PROFILE_H
+#define PHASE_PROFILE_H
+
+#include "PerfCounters.h"
+#include <vector>
+
+// Performance counters of a search per phase and per thread:
+//   enumeration  moving to the next lattice point (nextPoint)
+//   chaining     the ring chaining of a point (exploreRings without buildRadius)
+//   Hr fitting   buildRadius of the complete chains
+//   merging      filtering the results of a chunk and handing them over in lattice order, with the callback
+// The search phases alternate every few hundred cycles, too often to read the counters around each one.
+// The totals of the search are exact; they are split among its phases in the proportions measured on
+// every kSampleInterval-th lattice point. Merging is counted exactly. Every task fills its own PhaseProfile
+// and merge() adds them up; threads are numbered in the order they first counted something.
+class PhaseProfile {
+public:
+    enum Phase { Enumeration, Chaining, HrFitting, Merging, kPhases };
+    static const int kSampleInterval = 128;
+
+    // Counts of phase on the calling thread: of one sampled lattice point for the search phases, exact for Merging
+    void add(Phase phase, const PerfCounters::Sample& counts);
+    // Exact counts of the search on the calling thread, all sampled or not
+    void addSearch(const PerfCounters::Sample& counts);
+    void setAvailable(unsigned events) { available |= events; }
+
+    void merge(const PhaseProfile& other);
+    bool isEmpty() const { return threads.empty(); }
+    // Table per phase and per thread
+    void print() const;
+
+private:
+    struct ThreadCounts {
+        PerfCounters::Sample search;
+        PerfCounters::Sample phases[kPhases];
+    };
+
+    ThreadCounts& current();
+    // Search phases scaled to the exact search counts
+    void estimate(const ThreadCounts& counts, PerfCounters::Sample* phases) const;
+
+    std::vector<ThreadCounts> threads;  // by thread number
+    unsigned available = 0;
+};
+
+#endif // PHASE_PROFILE_H
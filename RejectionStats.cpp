@@ -0,0 +1,65 @@
+// RejectionStats.C
+
+#include "RejectionStats.h"
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+
+static const char* kReasonNames[RejectionStats::kReasons] = {"npoly%8", "gap", "overlap", "R_max", "costheta_min", "costheta_max"};
+
+RejectionStats::RejectionStats() : points(0), chains(0), built(0) {
+    std::fill(tried, tried + kMaxRings, 0);
+    std::fill(&rejected[0][0], &rejected[0][0] + kMaxRings * kReasons, 0);
+    for (int reason = 0; reason < kReasons; ++reason) {
+        closest[reason] = reason == CosthetaMin ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::infinity();
+    }
+}
+
+void RejectionStats::reject(int ring, Reason reason, double needed) {
+    ++rejected[ring][reason];
+    closest[reason] = reason == CosthetaMin ? std::max(closest[reason], needed) : std::min(closest[reason], needed);
+}
+
+void RejectionStats::merge(const RejectionStats& other) {
+    points += other.points;
+    chains += other.chains;
+    built += other.built;
+    for (int ring = 0; ring < kMaxRings; ++ring) {
+        tried[ring] += other.tried[ring];
+        for (int reason = 0; reason < kReasons; ++reason) rejected[ring][reason] += other.rejected[ring][reason];
+    }
+    for (int reason = 0; reason < kReasons; ++reason) {
+        closest[reason] = reason == CosthetaMin ? std::max(closest[reason], other.closest[reason]) : std::min(closest[reason], other.closest[reason]);
+    }
+}
+
+void RejectionStats::print(int n_rings) const {
+    printf("Rejections over %lld lattice points: %lld complete chains, %lld with an Hr for every species\n", points, chains, built);
+    printf("%6s %14s", "ring", "tried");
+    for (int reason = 0; reason < kReasons; ++reason) printf(" %14s", kReasonNames[reason]);
+    printf("\n");
+    for (int ring = 0; ring < std::min(n_rings, static_cast<int>(kMaxRings)); ++ring) {
+        printf("%6d %14lld", ring + 1, tried[ring]);
+        for (int reason = 0; reason < kReasons; ++reason) printf(" %14lld", rejected[ring][reason]);
+        printf("\n");
+    }
+
+    // Settings that would have accepted the closest rejected candidate
+    printf("Closest misses:");
+    bool any = false;
+    for (int reason = 0; reason < kReasons; ++reason) {
+        bool seen = reason == CosthetaMin ? closest[reason] > -std::numeric_limits<double>::infinity()
+                                          : closest[reason] < std::numeric_limits<double>::infinity();
+        if (!seen) continue;
+        any = true;
+        switch (reason) {
+            case Divisibility: printf(" polygon sides %.4f past the window of a multiple of 8;", closest[reason]); break;
+            case Gap: printf(" Gap_tolerance %.3e;", closest[reason]); break;
+            case Overlap: printf(" Overlap_max_mm %.3f;", closest[reason]); break;
+            case RMax: printf(" R_max %.3f;", closest[reason]); break;
+            case CosthetaMin: printf(" costheta_min below %.5f;", closest[reason]); break;
+            case CosthetaMax: printf(" costheta_max above %.5f;", closest[reason]); break;
+        }
+    }
+    printf(any ? "\n" : " none\n");
+}
@@ -0,0 +1,48 @@
+// RejectionStats.h
+
+#ifndef REJECTION_STATS_H
+#define REJECTION_STATS_H
+
+// Why the ring chaining dropped candidates, per ring, for scans that print few or no results.
+// A candidate is one species tried for a ring after a placed ring, or a complete chain needing an Hr for every
+// species; the Hr rejections are counted on the ring whose height decides.
+// Next to the counts, the closest rejected candidate of every constraint gives the setting that would
+// have let it through, so the constraint to relax can be read off without scanning again.
+// Every search task fills its own RejectionStats; merge() adds them up afterwards.
+class RejectionStats {
+public:
+    enum Reason {
+        Divisibility,  // neither floor(PolygonSides) nor the next integer is a multiple of 8
+        Gap,           // inner radius too far inside the previous ring: Gap_tolerance
+        Overlap,       // inner radius too far outside the previous ring: Overlap_max_mm
+        RMax,          // inner radius beyond R_max
+        CosthetaMin,   // no Hr on the grid with every ring of the species above costheta_min
+        CosthetaMax,   // no Hr on the grid up to Hreal_max with every ring below costheta_max
+        kReasons
+    };
+    static const int kMaxRings = 32;
+
+    RejectionStats();
+
+    void countTried(int ring) { ++tried[ring]; }
+    // A complete chain given to buildRadius, and one it found an Hr for
+    void countChain() { ++chains; }
+    void countBuilt() { ++built; }
+    void countPoint() { ++points; }
+    // needed: the setting of the constraint that would accept the candidate (distance to a multiple of 8
+    // beyond the accepted window for Divisibility); the closest one is kept.
+    void reject(int ring, Reason reason, double needed);
+
+    void merge(const RejectionStats& other);
+    // Table of counts per ring and the closest approach to every bound, for n_rings rings
+    void print(int n_rings) const;
+
+private:
+    long long points, chains, built;
+    long long tried[kMaxRings];
+    long long rejected[kMaxRings][kReasons];
+    // Smallest needed setting, except for CosthetaMin where the largest is the closest
+    double closest[kReasons];
+};
+
+#endif // REJECTION_STATS_H
@@ -0,0 +1,136 @@
+// ResultCache.C
+
+#include "ResultCache.h"
+#include "ResultQuery.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// FNV-1a over the bytes of one value after the other
+class KeyHash {
+public:
+    template <typename T> void add(const T& value) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+        for (std::size_t i = 0; i < sizeof(value); ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    uint64_t get() const { return hash; }
+
+private:
+    uint64_t hash = 14695981039346656037ULL;
+};
+
+ResultCache::ResultCache(const std::string& directory, const EndcapConfiguration& config, double step_length,
+                         const SearchOptions& options)
+    : directory(directory), config(config), wanted(ResultStore::makeHeader(config, step_length)) {
+    KeyHash hash;
+    hash.add(static_cast<int>(kSearchVersion));  // by value: the class constants have no definition to bind to
+    hash.add(static_cast<int>(ResultStore::kVersion));
+    hash.add(wanted.n_species);
+    hash.add(wanted.n_rings);
+    hash.add(wanted.n_min);
+    hash.add(wanted.n_max);
+    hash.add(wanted.step_length);
+    hash.add(wanted.r_min);
+    hash.add(wanted.r_max);
+    hash.add(wanted.l_min);
+    hash.add(wanted.l_max);
+    hash.add(wanted.hreal_min);
+    hash.add(wanted.hreal_max);
+    hash.add(wanted.costheta_max);
+    hash.add(static_cast<int>(options.chain_method));
+    key = hash.get();
+}
+
+int ResultCache::open() {
+    if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST) {
+        std::cerr << "Error: cannot create result cache " << directory << std::endl;
+        return 0;
+    }
+    if (access(directory.c_str(), R_OK | W_OK | X_OK) != 0) {
+        std::cerr << "Error: cannot use result cache " << directory << std::endl;
+        return 0;
+    }
+    return 1;
+}
+
+std::string ResultCache::segmentPath(long long begin, long long end) const {
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx.%lld-%lld.store", static_cast<unsigned long long>(key), begin, end);
+    return directory + "/" + name;
+}
+
+std::vector<ResultCache::Piece> ResultCache::plan(long long begin, long long end) const {
+    // Complete segments of this key inside [begin, end) that answer the tolerances of the scan
+    std::vector<Piece> segments;
+    if (DIR* dir = opendir(directory.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            unsigned long long entry_key;
+            long long first, last;
+            int length = 0;
+            if (sscanf(entry->d_name, "%16llx.%lld-%lld.store%n", &entry_key, &first, &last, &length) != 3 ||
+                entry->d_name[length] != '\0' || entry_key != key || first < begin || last > end || first >= last) continue;
+            std::string path = directory + "/" + entry->d_name;
+            ResultStore::Header stored;
+            FILE* in = fopen(path.c_str(), "rb");
+            if (!in) continue;
+            bool usable = fread(&stored, sizeof(stored), 1, in) == 1 && std::memcmp(stored.magic, wanted.magic, sizeof(stored.magic)) == 0 &&
+                          stored.version == ResultStore::kVersion && stored.sorted_index > 0 &&
+                          ResultStore::sameSearch(stored, wanted) && ResultStore::looseEnough(stored, wanted);
+            fclose(in);
+            if (usable) segments.push_back(Piece{first, last, path});
+        }
+        closedir(dir);
+    }
+    std::sort(segments.begin(), segments.end(), [](const Piece& a, const Piece& b) {
+        return a.begin != b.begin ? a.begin < b.begin : a.end > b.end;
+    });
+
+    // Take the segments in order, skipping those that overlap one already taken; search the gaps
+    std::vector<Piece> pieces;
+    long long position = begin;
+    for (auto& segment : segments) {
+        if (segment.begin < position) continue;
+        if (segment.begin > position) pieces.push_back(Piece{position, segment.begin, std::string()});
+        pieces.push_back(segment);
+        position = segment.end;
+    }
+    if (position < end) pieces.push_back(Piece{position, end, std::string()});
+    return pieces;
+}
+
+int ResultCache::read(const Piece& piece, const std::function<void(EndcapConfiguration&)>& visit) const {
+    ResultQuery segment;
+    if (!segment.open(piece.path.c_str())) return 0;
+    EndcapConfiguration cfg(config);
+    const ResultStore::Header& stored = segment.getHeader();
+    // A segment searched at the tolerances of the scan holds its results as they are
+    bool recheck = stored.gap_tolerance != wanted.gap_tolerance || stored.overlap_max != wanted.overlap_max ||
+                   stored.costheta_min != wanted.costheta_min;
+    for (long long record = 0; record < stored.n_records; ++record) {
+        segment.fill(record, cfg);
+        if (recheck && !cfg.passesTolerances(config.getGapTolerance(), config.getOverlapMax(), config.getCosthetaMin())) continue;
+        visit(cfg);
+    }
+    return 1;
+}
+
+std::string ResultCache::pendingPath(const Piece& piece) const {
+    return segmentPath(piece.begin, piece.end) + ".tmp" + std::to_string(getpid());
+}
+
+int ResultCache::publish(const Piece& piece) const {
+    std::string path = segmentPath(piece.begin, piece.end);
+    if (rename(pendingPath(piece).c_str(), path.c_str()) != 0) {
+        std::cerr << "Error: cannot add " << path << " to the result cache" << std::endl;
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,58 @@
+// ResultCache.h
+
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include "EndcapConfiguration.h"
+#include "EndcapSearch.h"
+#include "ResultStore.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Directory of result stores from earlier scans, so that running the same ini file again does not search again.
+// The key is a hash of the parsed settings that decide the results: the EndcapConfiguration bounds (not the
+// tolerances), step_length, Chain_search and kSearchVersion. Formatting, comments, key order and settings that
+// only change the speed, like N_threads or the ring state cache, do not change it.
+// Every scanned range [begin, end) of lattice points is one segment file <key>.<begin>-<end>.store holding
+// all configurations the search built, before the output filter. A scan is answered from the segments of
+// its key that lie inside its range and were searched at tolerances as loose or looser; only the gaps
+// between them are searched, and become new segments. Segments appear by rename once complete.
+class ResultCache {
+public:
+    // Raise whenever a change of the search changes which configurations it builds
+    static const int kSearchVersion = 1;
+
+    // Part of a scan: a cached segment, or with an empty path a range still to search
+    struct Piece {
+        long long begin, end;
+        std::string path;
+    };
+
+    ResultCache(const std::string& directory, const EndcapConfiguration& config, double step_length, const SearchOptions& options);
+
+    // Create the directory if needed; 0 and a message if it cannot be used.
+    int open();
+    uint64_t getKey() const { return key; }
+
+    // Split [begin, end) into cached segments and ranges to search, in lattice order.
+    std::vector<Piece> plan(long long begin, long long end) const;
+    // Hand every configuration of a cached piece that passes the tolerances of the configuration to visit,
+    // in lattice order; 0 and a message if the segment cannot be read.
+    int read(const Piece& piece, const std::function<void(EndcapConfiguration&)>& visit) const;
+
+    // File to write the results of a searched piece to, and make it a segment once the store is closed
+    std::string pendingPath(const Piece& piece) const;
+    int publish(const Piece& piece) const;
+
+private:
+    std::string segmentPath(long long begin, long long end) const;
+
+    std::string directory;
+    EndcapConfiguration config;
+    ResultStore::Header wanted;
+    uint64_t key;
+};
+
+#endif // RESULT_CACHE_H
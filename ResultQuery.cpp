@@ -0,0 +1,270 @@
+// ResultQuery.C
+
+#include "ResultQuery.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static double readDouble(const char* p) {
+    double value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+ResultQuery::~ResultQuery() {
+    if (base) munmap(const_cast<char*>(base), length);
+    if (fd >= 0) close(fd);
+}
+
+int ResultQuery::open(const char* path) {
+    fd = ::open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        std::cerr << "Error: cannot open result store " << path << std::endl;
+        return 0;
+    }
+    length = info.st_size;
+    if (length < sizeof(ResultStore::Header)) {
+        std::cerr << "Error: " << path << " is not a result store" << std::endl;
+        return 0;
+    }
+    void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Error: cannot map result store " << path << std::endl;
+        return 0;
+    }
+    base = static_cast<const char*>(mapped);
+    header = reinterpret_cast<const ResultStore::Header*>(base);
+
+    if (std::memcmp(header->magic, "ENDCAPRS", 8) != 0 || header->version != ResultStore::kVersion) {
+        std::cerr << "Error: " << path << " is not a result store of this version" << std::endl;
+        return 0;
+    }
+    layout = ResultStore::recordLayout(header->n_species, header->n_rings);
+    std::size_t n_keys = header->n_species + 2 * header->n_rings;
+    std::size_t sorted_end = header->sorted_index + n_keys * header->n_records * sizeof(ResultStore::SortedEntry);
+    if (header->sorted_index <= 0 || sorted_end != length) {
+        std::cerr << "Error: " << path << " is incomplete, the search writing it did not finish" << std::endl;
+        return 0;
+    }
+    return 1;
+}
+
+int ResultQuery::addTerm(const std::string& text) {
+    std::size_t op = text.find_first_of("<>=");
+    if (op == std::string::npos || op == 0) {
+        std::cerr << "Error: no comparison in query term " << text << std::endl;
+        return 0;
+    }
+    Term term;
+    std::string name = text.substr(0, op);
+    std::size_t value_begin = op + 1;
+    if (text[op] == '<') term.compare = Compare::Less;
+    else if (text[op] == '>') term.compare = Compare::Greater;
+    else term.compare = Compare::Equal;
+    if (text[op] != '=' && value_begin < text.size() && text[value_begin] == '=') {
+        term.compare = text[op] == '<' ? Compare::LessEqual : Compare::GreaterEqual;
+        ++value_begin;
+    }
+    std::string value = text.substr(value_begin);
+
+    term.index = -1;
+    std::size_t bracket = name.find('[');
+    if (bracket != std::string::npos) {
+        char* end;
+        term.index = static_cast<int>(strtol(name.c_str() + bracket + 1, &end, 10));
+        if (*end != ']' || end[1] != '\0' || term.index < 0) {
+            std::cerr << "Error: bad index in query term " << text << std::endl;
+            return 0;
+        }
+        name = name.substr(0, bracket);
+    }
+
+    if (name == "npoly" || name == "types") {
+        term.field = name == "npoly" ? Field::Npoly : Field::Types;
+        if (term.compare != Compare::Equal || term.index >= 0) {
+            std::cerr << "Error: " << name << " takes a whole tuple, e.g. " << name << "=96,112,112" << std::endl;
+            return 0;
+        }
+        const char* p = value.c_str();
+        while (*p) {
+            char* end;
+            long number = strtol(p, &end, 10);
+            if (end == p || (*end != ',' && *end != '\0')) {
+                std::cerr << "Error: bad tuple in query term " << text << std::endl;
+                return 0;
+            }
+            term.tuple.push_back(static_cast<int32_t>(number));
+            p = *end == ',' ? end + 1 : end;
+        }
+        if (static_cast<int>(term.tuple.size()) != header->n_rings) {
+            std::cerr << "Error: " << name << " needs " << header->n_rings << " values" << std::endl;
+            return 0;
+        }
+    } else {
+        if (name == "Hr") term.field = Field::Hr;
+        else if (name == "r_in") term.field = Field::RadiusIn;
+        else if (name == "r_out") term.field = Field::RadiusOut;
+        else {
+            std::cerr << "Error: unknown field " << name << ", use npoly, types, Hr, r_in or r_out" << std::endl;
+            return 0;
+        }
+        int limit = term.field == Field::Hr ? header->n_species : header->n_rings;
+        if (term.index >= limit) {
+            std::cerr << "Error: index out of range in query term " << text << std::endl;
+            return 0;
+        }
+        char* end;
+        term.value = strtod(value.c_str(), &end);
+        if (value.empty() || *end != '\0') {
+            std::cerr << "Error: bad number in query term " << text << std::endl;
+            return 0;
+        }
+    }
+    terms.push_back(term);
+    return 1;
+}
+
+int ResultQuery::sortedKey(Field field, int index) const {
+    if (field == Field::Hr) return index;
+    if (field == Field::RadiusIn) return header->n_species + index;
+    return header->n_species + header->n_rings + index;
+}
+
+bool ResultQuery::matches(const Term& term, long long record) const {
+    const char* data = recordData(record);
+    switch (term.field) {
+        case Field::Npoly:
+            return std::memcmp(data + layout.npoly, term.tuple.data(), term.tuple.size() * sizeof(int32_t)) == 0;
+        case Field::Types:
+            return std::memcmp(data + layout.types, term.tuple.data(), term.tuple.size() * sizeof(int32_t)) == 0;
+        default:
+            break;
+    }
+    std::size_t offset = term.field == Field::Hr ? layout.hr : layout.radius + (term.field == Field::RadiusOut ? sizeof(double) : 0);
+    std::size_t stride = term.field == Field::Hr ? sizeof(double) : 2 * sizeof(double);
+    int n = term.field == Field::Hr ? header->n_species : header->n_rings;
+    int first = term.index >= 0 ? term.index : 0;
+    int last = term.index >= 0 ? term.index + 1 : n;
+    for (int i = first; i < last; ++i) {
+        double value = readDouble(data + offset + i * stride);
+        bool ok = false;
+        switch (term.compare) {
+            case Compare::Less: ok = value < term.value; break;
+            case Compare::LessEqual: ok = value <= term.value; break;
+            case Compare::Greater: ok = value > term.value; break;
+            case Compare::GreaterEqual: ok = value >= term.value; break;
+            case Compare::Equal: ok = value == term.value; break;
+        }
+        if (!ok) return false;
+    }
+    return true;
+}
+
+const ResultStore::Bucket* ResultQuery::findBucket(long long section, uint64_t hash) const {
+    long long n_buckets = *reinterpret_cast<const long long*>(base + section);
+    auto buckets = reinterpret_cast<const ResultStore::Bucket*>(base + section + sizeof(long long));
+    for (long long slot = hash & (n_buckets - 1);; slot = (slot + 1) & (n_buckets - 1)) {
+        if (buckets[slot].count == 0) return nullptr;
+        if (buckets[slot].hash == hash) return &buckets[slot];
+    }
+}
+
+void ResultQuery::sortedRange(int key, Compare compare, double value, long long& first, long long& last) const {
+    long long n = header->n_records;
+    auto entries = reinterpret_cast<const ResultStore::SortedEntry*>(base + header->sorted_index) + key * n;
+    auto begin = entries;
+    auto end = entries + n;
+    auto lower = std::lower_bound(begin, end, value, [](const ResultStore::SortedEntry& e, double v) { return e.value < v; });
+    auto upper = std::upper_bound(begin, end, value, [](double v, const ResultStore::SortedEntry& e) { return v < e.value; });
+    switch (compare) {
+        case Compare::Less: first = 0; last = lower - begin; break;
+        case Compare::LessEqual: first = 0; last = upper - begin; break;
+        case Compare::Greater: first = upper - begin; last = n; break;
+        case Compare::GreaterEqual: first = lower - begin; last = n; break;
+        case Compare::Equal: first = lower - begin; last = upper - begin; break;
+    }
+}
+
+std::vector<long long> ResultQuery::run() {
+    static const char* kFieldNames[] = {"npoly", "types", "Hr", "r_in", "r_out"};
+    long long n = header->n_records;
+
+    // Pick the term whose index gives the fewest candidates; without terms every record is one
+    bool indexed = false;
+    long long best_count = n;
+    const long long* best_postings = nullptr;
+    const ResultStore::SortedEntry* best_entries = nullptr;
+    access_path = "scan";
+    for (auto& term : terms) {
+        if (term.field == Field::Npoly || term.field == Field::Types) {
+            long long section = term.field == Field::Npoly ? header->npoly_index : header->types_index;
+            const ResultStore::Bucket* bucket = findBucket(section, ResultStore::hashTuple(term.tuple.data(), header->n_rings));
+            long long count = bucket ? bucket->count : 0;
+            if (!indexed || count < best_count) {
+                indexed = true;
+                long long n_buckets = *reinterpret_cast<const long long*>(base + section);
+                auto postings = reinterpret_cast<const long long*>(base + section + sizeof(long long) + n_buckets * sizeof(ResultStore::Bucket));
+                best_count = count;
+                best_postings = postings + (bucket ? bucket->first : 0);
+                best_entries = nullptr;
+                access_path = std::string("hash ") + kFieldNames[static_cast<int>(term.field)];
+            }
+            continue;
+        }
+        int n_items = term.field == Field::Hr ? header->n_species : header->n_rings;
+        int first_item = term.index >= 0 ? term.index : 0;
+        int last_item = term.index >= 0 ? term.index + 1 : n_items;
+        for (int item = first_item; item < last_item; ++item) {
+            int key = sortedKey(term.field, item);
+            long long first, last;
+            sortedRange(key, term.compare, term.value, first, last);
+            if (!indexed || last - first < best_count) {
+                indexed = true;
+                best_count = last - first;
+                best_entries = reinterpret_cast<const ResultStore::SortedEntry*>(base + header->sorted_index) + key * n + first;
+                best_postings = nullptr;
+                access_path = std::string("sorted ") + kFieldNames[static_cast<int>(term.field)] + "[" + std::to_string(item) + "]";
+            }
+        }
+    }
+
+    std::vector<long long> matching;
+    candidates = best_count;
+    for (long long i = 0; i < best_count; ++i) {
+        long long record = best_postings ? best_postings[i] : best_entries ? best_entries[i].record : i;
+        bool ok = true;
+        for (auto& term : terms) {
+            if (!matches(term, record)) {
+                ok = false;
+                break;
+            }
+        }
+        if (ok) matching.push_back(record);
+    }
+    std::sort(matching.begin(), matching.end());
+    return matching;
+}
+
+void ResultQuery::fill(long long record, EndcapConfiguration& cfg) const {
+    const char* data = recordData(record);
+    for (int i = 0; i < header->n_species; ++i) {
+        cfg.getL1()[i] = readDouble(data + layout.l1 + i * sizeof(double));
+        cfg.getL2()[i] = readDouble(data + layout.l2 + i * sizeof(double));
+        cfg.getHr()[i] = readDouble(data + layout.hr + i * sizeof(double));
+    }
+    for (int i = 0; i < header->n_rings; ++i) {
+        cfg.getRadius()[i][0] = readDouble(data + layout.radius + 2 * i * sizeof(double));
+        cfg.getRadius()[i][1] = readDouble(data + layout.radius + (2 * i + 1) * sizeof(double));
+        int32_t value;
+        std::memcpy(&value, data + layout.npoly + i * sizeof(int32_t), sizeof(value));
+        cfg.getNpoly()[i] = value;
+        std::memcpy(&value, data + layout.types + i * sizeof(int32_t), sizeof(value));
+        cfg.getTypes()[i] = value;
+    }
+}
@@ -0,0 +1,71 @@
+// ResultQuery.h
+
+#ifndef RESULT_QUERY_H
+#define RESULT_QUERY_H
+
+#include "EndcapConfiguration.h"
+#include "ResultStore.h"
+#include <string>
+#include <vector>
+
+// Filters over a result store, answered from its indexes on the mapped file.
+// Terms, all of which must hold:
+//   npoly=96,112,112   types=0,1,2          whole tuple, through the hash indexes
+//   Hr[1]<135  r_in[2]>=800  r_out[0]<740   one species or ring, through the sorted indexes
+//   Hr<135  r_in>600                        every species or ring
+// with the comparisons <, <=, >, >= and =. The term with the fewest candidate records is looked up in
+// its index and only those records are read and checked against the other terms.
+class ResultQuery {
+public:
+    ResultQuery() = default;
+    ~ResultQuery();
+
+    ResultQuery(const ResultQuery&) = delete;
+    ResultQuery& operator=(const ResultQuery&) = delete;
+
+    // Map the store; 0 and a message if it is missing or not a complete store.
+    int open(const char* path);
+    // 0 and a message if the term is malformed
+    int addTerm(const std::string& text);
+
+    // Numbers of the matching records in store order
+    std::vector<long long> run();
+    // Copy record into cfg, which must have N_species and N_rings of the store
+    void fill(long long record, EndcapConfiguration& cfg) const;
+
+    const ResultStore::Header& getHeader() const { return *header; }
+    long long getCandidates() const { return candidates; }
+    // Index used by the last run(), "scan" if none
+    const std::string& getAccessPath() const { return access_path; }
+
+private:
+    enum class Field { Npoly, Types, Hr, RadiusIn, RadiusOut };
+    enum class Compare { Less, LessEqual, Greater, GreaterEqual, Equal };
+
+    struct Term {
+        Field field;
+        int index;  // species or ring, -1 for all
+        Compare compare;
+        double value;
+        std::vector<int32_t> tuple;
+    };
+
+    bool matches(const Term& term, long long record) const;
+    const ResultStore::Bucket* findBucket(long long section, uint64_t hash) const;
+    // Range of the sorted index of key that satisfies the comparison
+    void sortedRange(int key, Compare compare, double value, long long& first, long long& last) const;
+    int sortedKey(Field field, int index) const;
+    const char* recordData(long long record) const { return base + sizeof(ResultStore::Header) + record * layout.size; }
+
+    int fd = -1;
+    const char* base = nullptr;
+    std::size_t length = 0;
+    const ResultStore::Header* header = nullptr;
+    ResultStore::RecordLayout layout;
+    std::vector<Term> terms;
+
+    long long candidates = 0;
+    std::string access_path;
+};
+
+#endif // RESULT_QUERY_H
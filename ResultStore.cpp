@@ -0,0 +1,372 @@
+// ResultStore.C
+
+#include "ResultStore.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <unistd.h>
+
+static const char kMagic[8] = {'E', 'N', 'D', 'C', 'A', 'P', 'R', 'S'};
+
+// Entries read from a run file at a time during the merge
+static const std::size_t kMergeBufferEntries = 8192;
+
+// Doubles as integers of the same order (for all values but NaN and -0), so every index sorts one kind of key
+static uint64_t orderedBits(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+}
+
+static double fromOrderedBits(uint64_t bits) {
+    bits = (bits >> 63) ? bits & ~(1ULL << 63) : ~bits;
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+ResultStore::Header ResultStore::makeHeader(const EndcapConfiguration& config, double step_length) {
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.n_species = config.getNspecies();
+    header.n_rings = config.getNRings();
+    header.n_min = config.getNMin();
+    header.n_max = config.getNMax();
+    header.step_length = step_length;
+    header.r_min = config.getRMin();
+    header.r_max = config.getRMax();
+    header.l_min = config.getLMin();
+    header.l_max = config.getLMax();
+    header.hreal_min = config.getHrealMin();
+    header.hreal_max = config.getHrealMax();
+    header.costheta_min = config.getCosthetaMin();
+    header.costheta_max = config.getCosthetaMax();
+    header.gap_tolerance = config.getGapTolerance();
+    header.overlap_max = config.getOverlapMax();
+    return header;
+}
+
+ResultStore::ResultStore(const EndcapConfiguration& config, double step_length)
+    : header(makeHeader(config, step_length)), layout(recordLayout(config.getNspecies(), config.getNRings())),
+      record(layout.size), n_indexes(2 + config.getNspecies() + 2 * config.getNRings()), buffers(n_indexes) {}
+
+ResultStore::~ResultStore() {
+    if (file) fclose(file);
+    for (auto& run : runs) fclose(run.file);
+}
+
+ResultStore::RecordLayout ResultStore::recordLayout(int n_species, int n_rings) {
+    RecordLayout layout;
+    layout.l1 = 0;
+    layout.l2 = layout.l1 + sizeof(double) * n_species;
+    layout.hr = layout.l2 + sizeof(double) * n_species;
+    layout.radius = layout.hr + sizeof(double) * n_species;
+    layout.slack = layout.radius + sizeof(double) * 2 * n_rings;
+    layout.npoly = layout.slack + sizeof(double) * 3;
+    layout.types = layout.npoly + sizeof(int32_t) * n_rings;
+    layout.size = layout.types + sizeof(int32_t) * n_rings;
+    // Keep every record 8-byte aligned
+    layout.size = (layout.size + 7) / 8 * 8;
+    return layout;
+}
+
+// FNV-1a over the bytes of the values
+uint64_t ResultStore::hashTuple(const int32_t* values, int n) {
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(values);
+    for (std::size_t i = 0; i < n * sizeof(int32_t); ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int ResultStore::open(const char* path) {
+    this->path = path;
+    file = fopen(path, "wb");
+    if (!file) {
+        std::cerr << "Error: cannot create result store " << path << std::endl;
+        return 0;
+    }
+    count = 0;
+    failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    return 1;
+}
+
+void ResultStore::add(const EndcapConfiguration& cfg) {
+    if (!file) return;
+    char* p = record.data();
+    auto putDouble = [&p](double value) {
+        std::memcpy(p, &value, sizeof(value));
+        p += sizeof(value);
+    };
+    auto putInt = [&p](int value) {
+        int32_t v = value;
+        std::memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+    };
+    for (double value : cfg.getL1()) putDouble(value);
+    for (double value : cfg.getL2()) putDouble(value);
+    for (double value : cfg.getHr()) putDouble(value);
+    for (auto& r : cfg.getRadius()) {
+        putDouble(r[0]);
+        putDouble(r[1]);
+    }
+    EndcapConfiguration::ToleranceSlack slack = cfg.computeSlack();
+    putDouble(slack.gap);
+    putDouble(slack.overlap);
+    putDouble(slack.costheta);
+    for (int value : cfg.getNpoly()) putInt(value);
+    for (int value : cfg.getTypes()) putInt(value);
+
+    if (fwrite(record.data(), record.size(), 1, file) != 1) failed = true;
+    ++count;
+
+    long long number = count - 1;
+    buffers[0].push_back(IndexEntry{hashTuple(reinterpret_cast<const int32_t*>(record.data() + layout.npoly), header.n_rings), number});
+    buffers[1].push_back(IndexEntry{hashTuple(reinterpret_cast<const int32_t*>(record.data() + layout.types), header.n_rings), number});
+    int index = 2;
+    for (double value : cfg.getHr()) buffers[index++].push_back(IndexEntry{orderedBits(value), number});
+    for (auto& r : cfg.getRadius()) buffers[index++].push_back(IndexEntry{orderedBits(r[0]), number});
+    for (auto& r : cfg.getRadius()) buffers[index++].push_back(IndexEntry{orderedBits(r[1]), number});
+    ++buffered;
+    if (buffered * n_indexes * sizeof(IndexEntry) >= memory_limit) spill();
+}
+
+void ResultStore::sortBuffers() {
+    for (auto& buffer : buffers) {
+        // Records arrive in increasing order, so a stable sort orders equal keys by record
+        std::stable_sort(buffer.begin(), buffer.end(), [](const IndexEntry& a, const IndexEntry& b) { return a.key < b.key; });
+    }
+}
+
+// Sort the buffered entries and write them to a new run file, which is unlinked at once and so goes away with the process
+void ResultStore::spill() {
+    sortBuffers();
+
+    std::string name = path + ".runXXXXXX";
+    int fd = mkstemp(&name[0]);
+    FILE* run = fd >= 0 ? fdopen(fd, "w+b") : nullptr;
+    if (!run) {
+        // Keep going in memory
+        if (fd >= 0) ::close(fd);
+        std::cerr << "Warning: cannot create a run file next to " << path << ", keeping the index in memory" << std::endl;
+        memory_limit = static_cast<std::size_t>(-1);
+        return;
+    }
+    unlink(name.c_str());
+    for (auto& buffer : buffers) {
+        if (fwrite(buffer.data(), sizeof(IndexEntry), buffer.size(), run) != buffer.size()) failed = true;
+        buffer.clear();
+    }
+    runs.push_back(Run{run, buffered});
+    buffered = 0;
+}
+
+// Visit the entries of one index over all runs and the buffer in (key, record) order.
+// Every run holds later records than the runs before it, so taking the earliest run on equal keys keeps record order.
+template <typename Visit>
+void ResultStore::forEachMerged(int index, Visit visit) {
+    // A run file read through a buffer, or the sorted entries still in memory
+    struct Source {
+        FILE* file;
+        long long remaining;  // entries of the index still in the file
+        std::vector<IndexEntry> entries;
+        const IndexEntry* data;
+        std::size_t n, pos;
+
+        bool refill() {
+            n = static_cast<std::size_t>(std::min<long long>(remaining, kMergeBufferEntries));
+            entries.resize(n);
+            data = entries.data();
+            pos = 0;
+            if (n == 0 || fread(entries.data(), sizeof(IndexEntry), n, file) != n) return false;
+            remaining -= n;
+            return true;
+        }
+    };
+
+    std::vector<Source> sources;
+    sources.reserve(runs.size() + 1);
+    for (auto& run : runs) {
+        if (fseek(run.file, static_cast<long>(index * run.n_records * sizeof(IndexEntry)), SEEK_SET) != 0) failed = true;
+        sources.push_back(Source{run.file, run.n_records, {}, nullptr, 0, 0});
+        if (!sources.back().refill()) sources.pop_back();
+    }
+    if (!buffers[index].empty()) sources.push_back(Source{nullptr, 0, {}, buffers[index].data(), buffers[index].size(), 0});
+
+    // Heap of sources by their next entry, smallest key and then earliest source first
+    auto later = [&sources](int a, int b) {
+        const IndexEntry& x = sources[a].data[sources[a].pos];
+        const IndexEntry& y = sources[b].data[sources[b].pos];
+        return x.key != y.key ? x.key > y.key : a > b;
+    };
+    std::priority_queue<int, std::vector<int>, decltype(later)> heap(later);
+    for (int i = 0; i < static_cast<int>(sources.size()); ++i) heap.push(i);
+    while (!heap.empty()) {
+        int i = heap.top();
+        heap.pop();
+        Source& source = sources[i];
+        visit(source.data[source.pos]);
+        if (++source.pos < source.n || (source.file && source.refill())) heap.push(i);
+    }
+}
+
+void ResultStore::writeHashIndex(int index) {
+    // First pass: the groups of equal hashes and where they start in the record list
+    std::vector<Bucket> groups;
+    long long position = 0;
+    forEachMerged(index, [&groups, &position](const IndexEntry& entry) {
+        if (groups.empty() || groups.back().hash != entry.key) groups.push_back(Bucket{entry.key, position, 0});
+        ++groups.back().count;
+        ++position;
+    });
+
+    long long n_buckets = 1;
+    while (n_buckets < 2 * static_cast<long long>(groups.size())) n_buckets *= 2;
+    std::vector<Bucket> buckets(n_buckets, Bucket{0, 0, 0});
+    for (auto& group : groups) {
+        long long slot = group.hash & (n_buckets - 1);
+        while (buckets[slot].count != 0) slot = (slot + 1) & (n_buckets - 1);
+        buckets[slot] = group;
+    }
+    if (fwrite(&n_buckets, sizeof(n_buckets), 1, file) != 1) failed = true;
+    if (fwrite(buckets.data(), sizeof(Bucket), buckets.size(), file) != buckets.size()) failed = true;
+
+    // Second pass: the record numbers
+    std::vector<long long> out;
+    out.reserve(kMergeBufferEntries);
+    forEachMerged(index, [this, &out](const IndexEntry& entry) {
+        out.push_back(entry.record);
+        if (out.size() == kMergeBufferEntries) {
+            if (fwrite(out.data(), sizeof(long long), out.size(), file) != out.size()) failed = true;
+            out.clear();
+        }
+    });
+    if (fwrite(out.data(), sizeof(long long), out.size(), file) != out.size()) failed = true;
+}
+
+void ResultStore::writeSortedIndex(int index) {
+    std::vector<SortedEntry> out;
+    out.reserve(kMergeBufferEntries);
+    forEachMerged(index, [this, &out](const IndexEntry& entry) {
+        out.push_back(SortedEntry{fromOrderedBits(entry.key), entry.record});
+        if (out.size() == kMergeBufferEntries) {
+            if (fwrite(out.data(), sizeof(SortedEntry), out.size(), file) != out.size()) failed = true;
+            out.clear();
+        }
+    });
+    if (fwrite(out.data(), sizeof(SortedEntry), out.size(), file) != out.size()) failed = true;
+}
+
+int ResultStore::close() {
+    if (!file) return 1;
+
+    // The last entries are only sorted, they stay in memory for the merge
+    sortBuffers();
+    header.n_records = count;
+    header.npoly_index = ftell(file);
+    writeHashIndex(0);
+    header.types_index = ftell(file);
+    writeHashIndex(1);
+    header.sorted_index = ftell(file);
+    for (int index = 2; index < n_indexes; ++index) writeSortedIndex(index);
+    for (auto& run : runs) fclose(run.file);
+    runs.clear();
+    for (auto& buffer : buffers) std::vector<IndexEntry>().swap(buffer);
+    buffered = 0;
+    if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1) failed = true;
+
+    if (fclose(file) != 0) failed = true;
+    file = nullptr;
+    if (failed) {
+        std::cerr << "Error: could not write the whole result store" << std::endl;
+        return 0;
+    }
+    return 1;
+}
+
+bool ResultStore::sameSearch(const Header& stored, const Header& wanted) {
+    return stored.n_species == wanted.n_species && stored.n_rings == wanted.n_rings &&
+           stored.n_min == wanted.n_min && stored.n_max == wanted.n_max &&
+           stored.step_length == wanted.step_length && stored.r_min == wanted.r_min &&
+           stored.r_max == wanted.r_max && stored.l_min == wanted.l_min && stored.l_max == wanted.l_max &&
+           stored.hreal_min == wanted.hreal_min && stored.hreal_max == wanted.hreal_max &&
+           stored.costheta_max == wanted.costheta_max;
+}
+
+bool ResultStore::looseEnough(const Header& stored, const Header& wanted) {
+    return wanted.gap_tolerance <= stored.gap_tolerance && wanted.overlap_max <= stored.overlap_max &&
+           wanted.costheta_min >= stored.costheta_min;
+}
+
+int ResultStore::load(const char* path, const EndcapConfiguration& config, double step_length,
+                      std::vector<EndcapConfiguration>& results) {
+    FILE* in = fopen(path, "rb");
+    if (!in) {
+        std::cerr << "Error: cannot open result store " << path << std::endl;
+        return 0;
+    }
+    Header stored;
+    if (fread(&stored, sizeof(stored), 1, in) != 1 || std::memcmp(stored.magic, kMagic, sizeof(kMagic)) != 0 ||
+        stored.version != kVersion) {
+        std::cerr << "Error: " << path << " is not a result store of this version" << std::endl;
+        fclose(in);
+        return 0;
+    }
+
+    Header wanted = makeHeader(config, step_length);
+    if (!sameSearch(stored, wanted)) {
+        std::cerr << "Error: " << path << " was searched with other settings than the tolerances" << std::endl;
+        fclose(in);
+        return 0;
+    }
+    if (!looseEnough(stored, wanted)) {
+        std::cerr << "Error: " << path << " was searched at Gap_tolerance " << stored.gap_tolerance << ", Overlap_max_mm "
+                  << stored.overlap_max << ", costheta_min " << stored.costheta_min << "; looser settings need a new search" << std::endl;
+        fclose(in);
+        return 0;
+    }
+
+    std::vector<char> record(recordLayout(stored.n_species, stored.n_rings).size);
+    EndcapConfiguration cfg(config);
+    long long n_read = 0;
+    while (n_read < stored.n_records && fread(record.data(), record.size(), 1, in) == 1) {
+        ++n_read;
+        const char* p = record.data();
+        auto getDouble = [&p]() {
+            double value;
+            std::memcpy(&value, p, sizeof(value));
+            p += sizeof(value);
+            return value;
+        };
+        auto getInt = [&p]() {
+            int32_t value;
+            std::memcpy(&value, p, sizeof(value));
+            p += sizeof(value);
+            return static_cast<int>(value);
+        };
+        for (double& value : cfg.getL1()) value = getDouble();
+        for (double& value : cfg.getL2()) value = getDouble();
+        for (double& value : cfg.getHr()) value = getDouble();
+        for (auto& r : cfg.getRadius()) {
+            r[0] = getDouble();
+            r[1] = getDouble();
+        }
+        p += 3 * sizeof(double);  // the slack is recomputed from the radii when needed
+        for (int& value : cfg.getNpoly()) value = getInt();
+        for (int& value : cfg.getTypes()) value = getInt();
+        results.push_back(cfg);
+    }
+    bool complete = n_read == stored.n_records;
+    fclose(in);
+    if (!complete) {
+        std::cerr << "Error: could not read the whole result store " << path << std::endl;
+        return 0;
+    }
+    return 1;
+}
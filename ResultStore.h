@@ -0,0 +1,131 @@
+// ResultStore.h
+
+#ifndef RESULT_STORE_H
+#define RESULT_STORE_H
+
+#include "EndcapConfiguration.h"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Binary file of the configurations found by one search, so they can be filtered again without searching.
+// A header holds the settings of the search, then every configuration is one fixed-size record:
+// L1, L2, Hr (N_species doubles each), the inner and outer radius of every ring, the tolerance slack
+// (gap, overlap, costheta), then npoly and types (N_rings int32 each). Numbers are in native byte order.
+// A search at loose tolerances answers every tighter Gap_tolerance, Overlap_max_mm and costheta_min:
+// the chains and Hr it builds do not depend on them, tighter settings only drop configurations.
+//
+// close() appends secondary indexes for ResultQuery and completes the header; a store is valid only after it.
+// The index entries are collected in memory up to a limit, beyond which they are sorted and spilled to
+// unlinked run files next to the store; close() merges the runs, so the store does not depend on the limit.
+// Hash indexes on the npoly tuple and on the types tuple: an open addressing table of
+// Bucket{hash, first, count} (count 0: empty) over a list of record numbers grouped by tuple hash.
+// Sorted indexes: for every Hr, then inner and outer radius of every ring, n_records SortedEntry{value, record}
+// in increasing value. Every section starts 8-byte aligned, so a mapped store can be used in place.
+class ResultStore {
+public:
+    struct Header {
+        char magic[8];  // "ENDCAPRS"
+        int version;
+        int n_species, n_rings;
+        int n_min, n_max;
+        int reserved;
+        double step_length;
+        double r_min, r_max, l_min, l_max;
+        double hreal_min, hreal_max;
+        double costheta_min, costheta_max;
+        double gap_tolerance, overlap_max;
+        long long n_records;
+        // File offsets of the index sections
+        long long npoly_index, types_index, sorted_index;
+    };
+
+    // Byte offsets of the fields within a record
+    struct RecordLayout {
+        std::size_t l1, l2, hr, radius, slack, npoly, types, size;
+    };
+
+    // Hash index section: n_buckets (a power of two), then the buckets, then n_records record numbers
+    struct Bucket {
+        uint64_t hash;
+        long long first, count;
+    };
+
+    struct SortedEntry {
+        double value;
+        long long record;
+    };
+
+    static const int kVersion = 2;
+    static const std::size_t kDefaultMemoryLimit = 256u << 20;
+
+    ResultStore(const EndcapConfiguration& config, double step_length);
+    ~ResultStore();
+
+    ResultStore(const ResultStore&) = delete;
+    ResultStore& operator=(const ResultStore&) = delete;
+
+    // Create or truncate the file and write the header; 0 and a message on failure.
+    int open(const char* path);
+    void add(const EndcapConfiguration& cfg);
+    // Write the indexes and the header, and close; 0 and a message if anything could not be written.
+    int close();
+    long getCount() const { return count; }
+    // Memory for the index entries of records not yet spilled to run files; call before open().
+    void setMemoryLimit(std::size_t bytes) { memory_limit = bytes; }
+    // Number of run files spilled so far
+    int getRuns() const { return static_cast<int>(runs.size()); }
+
+    // Header of a store of the search of config with step_length
+    static Header makeHeader(const EndcapConfiguration& config, double step_length);
+    // Whether stored was searched with the settings of wanted apart from the tolerances
+    static bool sameSearch(const Header& stored, const Header& wanted);
+    // Whether the tolerances of stored are as loose as those of wanted or looser, so it holds all results of wanted
+    static bool looseEnough(const Header& stored, const Header& wanted);
+    static RecordLayout recordLayout(int n_species, int n_rings);
+    // Hash of an npoly or types tuple, the key of the hash indexes
+    static uint64_t hashTuple(const int32_t* values, int n);
+
+    // Read every configuration of the store at path. config must have the settings the store was searched
+    // with, except that Gap_tolerance and Overlap_max_mm may be tighter (smaller) and costheta_min larger.
+    // Returns 0 and a message if the file cannot be read or was searched with other settings.
+    static int load(const char* path, const EndcapConfiguration& config, double step_length,
+                    std::vector<EndcapConfiguration>& results);
+
+private:
+    // Entry of an index being built: the tuple hash or the sorted value as an order-preserving integer, and the record
+    struct IndexEntry {
+        uint64_t key;
+        long long record;
+    };
+    // Entries of the records of one spill, every index sorted, one index after the other
+    struct Run {
+        FILE* file;
+        long long n_records;
+    };
+
+    void sortBuffers();
+    void spill();
+    template <typename Visit> void forEachMerged(int index, Visit visit);
+    void writeHashIndex(int index);
+    void writeSortedIndex(int index);
+
+    Header header;
+    RecordLayout layout;
+    std::string path;
+    FILE* file = nullptr;
+    long count = 0;
+    bool failed = false;
+    std::vector<char> record;
+
+    // Index 0 is npoly, 1 types, then every Hr, every inner radius and every outer radius.
+    // The entries of the records since the last spill; they are spilled once they would take more than memory_limit.
+    int n_indexes;
+    std::size_t memory_limit = kDefaultMemoryLimit;
+    long long buffered = 0;
+    std::vector<std::vector<IndexEntry>> buffers;
+    std::vector<Run> runs;
+};
+
+#endif // RESULT_STORE_H
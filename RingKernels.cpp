@@ -0,0 +1,227 @@
+// RingKernels.C
+
+#include "RingKernels.h"
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RING_KERNELS_X86
+#endif
+
+// Kernel bodies are written once and inlined into a function per instruction set, which the compiler
+// vectorizes for that set. FMA only enters the float prefilter: the double kernels have no sums to contract.
+#define KERNEL_BODY inline __attribute__((always_inline))
+#define KERNEL_AVX2 __attribute__((target("avx2,fma")))
+#define KERNEL_AVX512 __attribute__((target("avx512f,avx512vl,avx2,fma")))
+
+// Margin on the polygon side count, relative to the count itself. The float estimate is within
+// about 1e-6 of the float value PolygonSides returns, so this leaves a factor of 100.
+static const float kSidesMargin = 1e-4f;
+// Margin on the window bounds, relative to the radius; the float radius is within about 1e-6.
+static const double kRadiusMargin = 1e-4;
+// The series below are accurate to better than 1e-7 for L1/2r in this range.
+static const float kRatioMin = 1e-3f;
+static const float kRatioMax = 0.25f;
+// Adding and removing 1.5*2^23 rounds to an integer without integer conversions
+static const float kRoundingShift = 12582912.0f;
+
+// Block lanes: one SSE register of floats, or all kPrefilterLanes in one AVX register
+template <int Block>
+static KERNEL_BODY void prefilterBody(double r, const float* L1, int n_species, double r_min, double r_max, int* keep) {
+    const float pi = 3.14159265f;
+    const float inv_two_r = static_cast<float>(1 / (2 * r));
+    const float two_lo = static_cast<float>(2 * r_min * (1 - kRadiusMargin));
+    const float two_hi = static_cast<float>(2 * r_max * (1 + kRadiusMargin));
+
+    for (int block = 0; block < n_species; block += Block) {
+        // Branch-free so the block vectorizes; lanes outside the valid range compute garbage that is masked out
+        for (int i = block; i < block + Block; ++i) {
+            float x = L1[i] * inv_two_r;
+            int in_range = (x >= kRatioMin) & (x <= kRatioMax);
+
+            // asin(x) to x^9 and the number of sides of the polygon inscribed in r
+            float x2 = x * x;
+            float asin_x = x * (1.0f + x2 * (1.0f / 6 + x2 * (3.0f / 40 + x2 * (15.0f / 336 + x2 * (105.0f / 3456)))));
+            float sides = pi / asin_x;
+
+            // Nearest multiple of 8: nextCircles only accepts floor(sides) or floor(sides) + 1 divisible by 8
+            float eighths = (sides * 0.125f + kRoundingShift) - kRoundingShift;
+            float distance = std::fabs(sides - 8.0f * eighths);
+
+            // sin(pi/n) to t^7; the next inner radius L1 / (2 sin(pi/n)) is compared without dividing
+            float t = (pi * 0.125f) / eighths;
+            float t2 = t * t;
+            float sin_t = t * (1.0f - t2 * (1.0f / 6) * (1.0f - t2 * (1.0f / 20) * (1.0f - t2 * (1.0f / 42))));
+
+            int may_pass = (distance <= 1.0f + kSidesMargin * sides)
+                         & (L1[i] >= two_lo * sin_t) & (L1[i] <= two_hi * sin_t);
+            keep[i] = (in_range ^ 1) | may_pass;
+        }
+    }
+}
+
+// Registers of doubles as GCC vector extensions, lowered to whatever instruction set the function is compiled for.
+// The compiler does not vectorize a search that exits early on its own.
+template <int Lanes>
+struct DoubleLanes;
+template <>
+struct DoubleLanes<2> {
+    typedef double Values __attribute__((vector_size(16)));
+    typedef long long Mask __attribute__((vector_size(16)));
+};
+template <>
+struct DoubleLanes<4> {
+    typedef double Values __attribute__((vector_size(32)));
+    typedef long long Mask __attribute__((vector_size(32)));
+};
+
+// A block of Lanes grid values is compared at once; the NaN padding never matches.
+template <int Lanes>
+static KERNEL_BODY int firstHrIndexBody(const double* grid, int n_grid, double lowest, double tallest, double costheta_min,
+                                        double costheta_max) {
+    typedef typename DoubleLanes<Lanes>::Values Values;
+    typedef typename DoubleLanes<Lanes>::Mask Mask;
+    for (int block = 0; block < n_grid; block += Lanes) {
+        Values h;
+        std::memcpy(&h, grid + block, sizeof(h));
+        Mask match = (tallest < h * costheta_max) & (lowest > h * costheta_min);
+        long long any = 0;
+        for (int j = 0; j < Lanes; ++j) any |= match[j];
+        if (!any) continue;
+        for (int j = 0; j < Lanes; ++j) {
+            if (match[j]) return block + j;
+        }
+    }
+    return -1;
+}
+
+// The loads by species and npoly are gathers, which cost more than the divisions; the instruction set
+// level only changes the encoding here, with no vector loop.
+static KERNEL_BODY void ringRadiiBody(const double* L1, const double* L2, const int* types, const int* npoly, int n_rings,
+                                      const double* sin_den, const double* tan_den, double* radius) {
+    for (int i = 0; i < n_rings; ++i) {
+        radius[2 * i] = L1[types[i]] / sin_den[npoly[i]];
+        radius[2 * i + 1] = L2[types[i]] / tan_den[npoly[i]];
+    }
+}
+
+static void prefilterBaseline(double r, const float* L1, int n_species, double r_min, double r_max, int* keep) {
+    prefilterBody<4>(r, L1, n_species, r_min, r_max, keep);
+}
+static int firstHrIndexBaseline(const double* grid, int n_grid, double lowest, double tallest, double costheta_min, double costheta_max) {
+    return firstHrIndexBody<2>(grid, n_grid, lowest, tallest, costheta_min, costheta_max);
+}
+static void ringRadiiBaseline(const double* L1, const double* L2, const int* types, const int* npoly, int n_rings,
+                              const double* sin_den, const double* tan_den, double* radius) {
+    ringRadiiBody(L1, L2, types, npoly, n_rings, sin_den, tan_den, radius);
+}
+
+#ifdef RING_KERNELS_X86
+KERNEL_AVX2 static void prefilterAvx2(double r, const float* L1, int n_species, double r_min, double r_max, int* keep) {
+    prefilterBody<kPrefilterLanes>(r, L1, n_species, r_min, r_max, keep);
+}
+KERNEL_AVX2 static int firstHrIndexAvx2(const double* grid, int n_grid, double lowest, double tallest, double costheta_min,
+                                        double costheta_max) {
+    return firstHrIndexBody<kHrLanes>(grid, n_grid, lowest, tallest, costheta_min, costheta_max);
+}
+KERNEL_AVX2 static void ringRadiiAvx2(const double* L1, const double* L2, const int* types, const int* npoly, int n_rings,
+                                      const double* sin_den, const double* tan_den, double* radius) {
+    ringRadiiBody(L1, L2, types, npoly, n_rings, sin_den, tan_den, radius);
+}
+
+KERNEL_AVX512 static void prefilterAvx512(double r, const float* L1, int n_species, double r_min, double r_max, int* keep) {
+    prefilterBody<kPrefilterLanes>(r, L1, n_species, r_min, r_max, keep);
+}
+KERNEL_AVX512 static int firstHrIndexAvx512(const double* grid, int n_grid, double lowest, double tallest, double costheta_min,
+                                            double costheta_max) {
+    // Eight lanes would compare into a mask register, which GCC reads back lane by lane
+    return firstHrIndexBody<kHrLanes>(grid, n_grid, lowest, tallest, costheta_min, costheta_max);
+}
+KERNEL_AVX512 static void ringRadiiAvx512(const double* L1, const double* L2, const int* types, const int* npoly, int n_rings,
+                                          const double* sin_den, const double* tan_den, double* radius) {
+    ringRadiiBody(L1, L2, types, npoly, n_rings, sin_den, tan_den, radius);
+}
+#endif
+
+namespace {
+
+struct KernelTable {
+    void (*prefilterNextRing)(double, const float*, int, double, double, int*);
+    int (*firstHrIndex)(const double*, int, double, double, double, double);
+    void (*ringRadii)(const double*, const double*, const int*, const int*, int, const double*, const double*, double*);
+};
+
+// By KernelIsa
+#ifdef RING_KERNELS_X86
+const KernelTable kTables[] = {{prefilterBaseline, firstHrIndexBaseline, ringRadiiBaseline},
+                               {prefilterAvx2, firstHrIndexAvx2, ringRadiiAvx2},
+                               {prefilterAvx512, firstHrIndexAvx512, ringRadiiAvx512}};
+#else
+const KernelTable kTables[] = {{prefilterBaseline, firstHrIndexBaseline, ringRadiiBaseline}};
+#endif
+
+// Changed only by selectKernelIsa(), before main from the CPU and then before the search threads start
+std::atomic<int> active_isa(static_cast<int>(KernelIsa::Baseline));
+std::atomic<const KernelTable*> active(&kTables[0]);
+const KernelIsa startup_isa = selectKernelIsa();
+
+}  // namespace
+
+bool isKernelIsaSupported(KernelIsa isa) {
+#ifdef RING_KERNELS_X86
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    switch (isa) {
+        case KernelIsa::Baseline: return true;
+        case KernelIsa::Avx2: return avx2;
+        case KernelIsa::Avx512: return avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl");
+    }
+    return false;
+#else
+    return isa == KernelIsa::Baseline;
+#endif
+}
+
+KernelIsa selectKernelIsa(KernelIsa cap) {
+    int isa = static_cast<int>(cap);
+    while (isa > 0 && !isKernelIsaSupported(static_cast<KernelIsa>(isa))) --isa;
+    active_isa = isa;
+    active = &kTables[isa];
+    return static_cast<KernelIsa>(isa);
+}
+
+KernelIsa getKernelIsa() {
+    return static_cast<KernelIsa>(active_isa.load());
+}
+
+const char* kernelIsaName(KernelIsa isa) {
+    static const char* kNames[] = {"baseline", "avx2", "avx512"};
+    return kNames[static_cast<int>(isa)];
+}
+
+bool parseKernelIsa(const char* name, KernelIsa& isa) {
+    if (std::strcmp(name, "auto") == 0 || std::strcmp(name, "avx512") == 0) {
+        isa = KernelIsa::Avx512;
+    } else if (std::strcmp(name, "avx2") == 0) {
+        isa = KernelIsa::Avx2;
+    } else if (std::strcmp(name, "baseline") == 0) {
+        isa = KernelIsa::Baseline;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void prefilterNextRing(double r, const float* L1, int n_species, double r_min, double r_max, int* keep) {
+    active.load(std::memory_order_relaxed)->prefilterNextRing(r, L1, n_species, r_min, r_max, keep);
+}
+
+int firstHrIndex(const double* grid, int n_grid, double lowest, double tallest, double costheta_min, double costheta_max) {
+    return active.load(std::memory_order_relaxed)->firstHrIndex(grid, n_grid, lowest, tallest, costheta_min, costheta_max);
+}
+
+void ringRadii(const double* L1, const double* L2, const int* types, const int* npoly, int n_rings, const double* sin_den,
+               const double* tan_den, double* radius) {
+    active.load(std::memory_order_relaxed)->ringRadii(L1, L2, types, npoly, n_rings, sin_den, tan_den, radius);
+}
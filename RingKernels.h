@@ -0,0 +1,45 @@
+// RingKernels.h
+
+#ifndef RING_KERNELS_H
+#define RING_KERNELS_H
+
+// Lanes of the float32 prefilter: one per species, padded to a whole number of SIMD registers.
+const int kPrefilterLanes = 8;
+// The Hr grid given to firstHrIndex is padded with NaN to a multiple of kHrLanes.
+const int kHrLanes = 4;
+
+// Instruction set the kernels below run with. Every kernel is compiled once per level and the level is
+// chosen at startup from the CPU, so one binary runs on every x86-64 machine; the results are the same
+// on every level. Other architectures only have Baseline.
+enum class KernelIsa {
+    Baseline,  // whatever the compiler flags allow, SSE2 on x86-64
+    Avx2,      // AVX2 and FMA
+    Avx512     // AVX-512F and VL
+};
+
+// Use the best level the CPU supports, at most cap; returns the level in use.
+KernelIsa selectKernelIsa(KernelIsa cap = KernelIsa::Avx512);
+KernelIsa getKernelIsa();
+bool isKernelIsaSupported(KernelIsa isa);
+const char* kernelIsaName(KernelIsa isa);
+// auto, baseline, avx2 or avx512; false for anything else
+bool parseKernelIsa(const char* name, KernelIsa& isa);
+
+// Float32 first pass of nextCircles for all species at once.
+// r is the outer radius of the previous ring, L1 the inner side length of each species padded
+// to kPrefilterLanes, [r_min, r_max] the window the inner radius of the next ring must fall into.
+// keep[i] is set to 0 only when the double-precision check in nextCircles is certain to reject
+// species i: the error bounds of the float arithmetic are covered by generous margins, and
+// ratios L1/2r outside the range the approximations are valid for are always kept.
+void prefilterNextRing(double r, const float* L1, int n_species, double r_min, double r_max, int* keep);
+
+// Index of the first h of grid[0, n_grid) with tallest < h * costheta_max and lowest > h * costheta_min,
+// -1 if there is none. These are the Hr checks of buildRadius for the highest and the lowest ring of a species.
+int firstHrIndex(const double* grid, int n_grid, double lowest, double tallest, double costheta_min, double costheta_max);
+
+// Inner and outer radius of every ring, written as radius[2i] and radius[2i+1]: the side lengths L1 and L2 of
+// its species types[i] over the polygon denominators 2 sin(pi/n) and 2 tan(pi/n) tabulated for n = npoly[i].
+void ringRadii(const double* L1, const double* L2, const int* types, const int* npoly, int n_rings, const double* sin_den,
+               const double* tan_den, double* radius);
+
+#endif // RING_KERNELS_H
@@ -0,0 +1,65 @@
+// RunPlanner.C
+
+#include "RunPlanner.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+RunEstimate estimateRun(const EndcapConfiguration& config, const ParameterLattice& lattice, const SearchOptions& options,
+                        const EndcapOptimizer::Filter& filter, int n_blocks, int block_points) {
+    RunEstimate estimate;
+    estimate.lattice_points = lattice.size();
+    if (lattice.size() == 0 || n_blocks <= 0 || block_points <= 0) return estimate;
+
+    // Small lattices are searched whole
+    long long span = std::max<long long>(lattice.size() - block_points, 0);
+    if (static_cast<long long>(n_blocks) * block_points >= lattice.size()) {
+        n_blocks = 1;
+        block_points = static_cast<int>(lattice.size());
+        span = 0;
+    }
+
+    const double golden = 0.6180339887498949;
+    double seconds = 0, kept_sum = 0, kept_sq_sum = 0;
+    long long results = 0, surviving = 0;
+    std::vector<EndcapConfiguration> config_list;
+
+    for (int b = 0; b < n_blocks; ++b) {
+        double u = std::fmod(0.5 + b * golden, 1.0);
+        long long begin = static_cast<long long>(u * span);
+        long long end = std::min(begin + block_points, lattice.size());
+
+        auto start = std::chrono::steady_clock::now();
+        EndcapSearch search(config, lattice, begin, end, options);
+        long long kept = 0;
+        for (;;) {
+            config_list.clear();
+            if (search.run(1, config_list) == 0) break;
+            if (!config_list.empty()) ++surviving;
+            results += config_list.size();
+            for (auto& cfg : config_list) {
+                if (!filter || filter(cfg)) ++kept;
+            }
+        }
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        double rate = static_cast<double>(kept) / (end - begin);
+        kept_sum += kept;
+        kept_sq_sum += rate * rate;
+        estimate.sampled_points += end - begin;
+    }
+
+    double n = static_cast<double>(estimate.sampled_points);
+    estimate.blocks = n_blocks;
+    estimate.seconds_per_point = seconds / n;
+    estimate.results_per_point = results / n;
+    estimate.kept_per_point = kept_sum / n;
+    estimate.point_survival = surviving / n;
+    if (n_blocks > 1) {
+        double mean = estimate.kept_per_point;
+        double variance = std::max(kept_sq_sum / n_blocks - mean * mean, 0.0) * n_blocks / (n_blocks - 1);
+        estimate.kept_per_point_error = std::sqrt(variance / n_blocks);
+    }
+    return estimate;
+}
@@ -0,0 +1,29 @@
+// RunPlanner.h
+
+#ifndef RUN_PLANNER_H
+#define RUN_PLANNER_H
+
+#include "EndcapConfiguration.h"
+#include "EndcapOptimizer.h"
+#include "EndcapSearch.h"
+#include "ParameterLattice.h"
+
+// Extrapolation of a full scan from a sample of the lattice
+struct RunEstimate {
+    long long lattice_points = 0;
+    long long sampled_points = 0;
+    int blocks = 0;
+    double seconds_per_point = 0;      // single thread
+    double results_per_point = 0;      // configurations built
+    double kept_per_point = 0;         // configurations passing the filter
+    double kept_per_point_error = 0;   // standard error of kept_per_point over the blocks
+    double point_survival = 0;         // fraction of sampled points with at least one configuration built
+};
+
+// Search n_blocks blocks of block_points consecutive lattice points on one thread. The blocks start at
+// the golden-ratio sequence over the index range, which covers every part of the lattice evenly,
+// and consecutive points keep the per-point cost as in a real scan.
+RunEstimate estimateRun(const EndcapConfiguration& config, const ParameterLattice& lattice, const SearchOptions& options,
+                        const EndcapOptimizer::Filter& filter, int n_blocks, int block_points);
+
+#endif // RUN_PLANNER_H
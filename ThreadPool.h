@@ -0,0 +1,42 @@
+// ThreadPool.h
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads fed from a single FIFO task queue.
+// Several searches can submit work to the same pool and wait() for all of it.
+class ThreadPool {
+public:
+    // num_threads <= 0 uses the number of hardware threads.
+    explicit ThreadPool(int num_threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(std::function<void()> task);
+    // Block until every task submitted so far has finished.
+    void wait();
+
+    int size() const { return static_cast<int>(workers.size()); }
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable task_cv;
+    std::condition_variable done_cv;
+    int pending = 0;
+    bool stopping = false;
+};
+
+#endif // THREAD_POOL_H
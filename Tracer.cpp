@@ -0,0 +1,121 @@
+// Tracer.C
+
+#include "Tracer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct Event {
+    const char* name;
+    uint64_t begin, end;
+};
+
+// Ring buffer of one level; count is the number of events ever recorded, the latest events.size() are kept
+struct Ring {
+    std::vector<Event> events;
+    uint64_t count = 0;
+};
+
+// One ring per level, so the many chain spans cannot push out the task spans
+struct ThreadBuffer {
+    int tid;
+    Ring rings[Tracer::Chains];
+};
+
+std::mutex buffers_mutex;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+std::size_t buffer_events = 0;
+std::string trace_path;
+uint64_t start_time = 0;
+thread_local ThreadBuffer* thread_buffer = nullptr;
+
+// The first span of a thread registers its buffer, later ones only write it
+ThreadBuffer* threadBuffer() {
+    if (!thread_buffer) {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        buffers.emplace_back(new ThreadBuffer());
+        thread_buffer = buffers.back().get();
+        thread_buffer->tid = static_cast<int>(buffers.size());
+        for (auto& ring : thread_buffer->rings) ring.events.resize(buffer_events);
+    }
+    return thread_buffer;
+}
+
+void dumpAtExit() {
+    Tracer::dump(trace_path);
+}
+
+}  // namespace
+
+std::atomic<int> Tracer::current_level(Tracer::Off);
+
+bool Tracer::compiledIn() {
+#ifdef ENDCAP_TRACE
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t Tracer::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Tracer::start(const std::string& path, int level, std::size_t events_per_thread) {
+    trace_path = path;
+    buffer_events = std::max<std::size_t>(events_per_thread, 1);
+    start_time = now();
+    current_level = level;
+    static bool registered = false;
+    if (!registered) std::atexit(dumpAtExit);
+    registered = true;
+}
+
+void Tracer::record(const char* name, int level, uint64_t begin, uint64_t end) {
+    Ring& ring = threadBuffer()->rings[level - 1];
+    ring.events[ring.count % ring.events.size()] = Event{name, begin, end};
+    ++ring.count;
+}
+
+int Tracer::dump(const std::string& path) {
+    current_level = Off;
+    FILE* out = fopen(path.c_str(), "w");
+    if (!out) {
+        std::cerr << "Error: cannot write the trace " << path << std::endl;
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"runOptimization\"}}");
+    long long written = 0, dropped = 0;
+    for (auto& buffer : buffers) {
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", buffer->tid,
+                buffer->tid);
+        for (auto& ring : buffer->rings) {
+            uint64_t capacity = ring.events.size();
+            uint64_t first = ring.count > capacity ? ring.count - capacity : 0;
+            dropped += first;
+            for (uint64_t i = first; i < ring.count; ++i) {
+                const Event& event = ring.events[i % capacity];
+                // Microseconds since start(), as the format wants them
+                fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event.name,
+                        buffer->tid, (event.begin - start_time) / 1e3, (event.end - event.begin) / 1e3);
+                ++written;
+            }
+        }
+    }
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0) {
+        std::cerr << "Error: cannot write the trace " << path << std::endl;
+        return 0;
+    }
+    printf("Trace: %lld spans of %zu threads in %s, %lld older spans dropped\n", written, buffers.size(), path.c_str(), dropped);
+    return 1;
+}
@@ -0,0 +1,61 @@
+// Tracer.h
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Timed spans of the search threads, written as Chrome trace JSON for chrome://tracing or ui.perfetto.dev.
+// The spans are compiled in with make TRACE=1 (-DENDCAP_TRACE); otherwise TRACE_SPAN expands to nothing.
+// Compiled in, tracing stays off until start(), and a span costs one relaxed load and a branch.
+// Every thread records finished spans into its own ring buffers of fixed size, one per level, which keep
+// the latest events; only that thread writes them, so recording takes no lock. The buffers are written to the trace
+// file when the program exits, after the thread pools have joined their threads.
+class Tracer {
+public:
+    // Spans recorded at each level: task chunks, then also every chain exploration and buildRadius
+    enum Level { Off = 0, Tasks = 1, Chains = 2 };
+
+    // Record the spans up to level, keeping the latest events_per_thread of every thread and level, and write them to path at exit
+    static void start(const std::string& path, int level, std::size_t events_per_thread);
+    static bool enabled(int level) { return current_level.load(std::memory_order_relaxed) >= level; }
+    static bool compiledIn();
+
+    // Nanoseconds on the steady clock
+    static uint64_t now();
+    static void record(const char* name, int level, uint64_t begin, uint64_t end);
+    // Write every buffer as JSON; 0 and a message on failure. No thread may record meanwhile.
+    static int dump(const std::string& path);
+
+    // Records from construction to destruction if level is enabled; name must be a string literal
+    class Span {
+    public:
+        Span(const char* name, int level) : name(enabled(level) ? name : nullptr), level(level), begin(this->name ? now() : 0) {}
+        ~Span() {
+            if (name) record(name, level, begin, now());
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        const char* name;
+        int level;
+        uint64_t begin;
+    };
+
+private:
+    static std::atomic<int> current_level;
+};
+
+#ifdef ENDCAP_TRACE
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SPAN(name, level) Tracer::Span TRACE_CONCAT(trace_span_, __LINE__)(name, Tracer::level)
+#else
+#define TRACE_SPAN(name, level)
+#endif
+
+#endif // TRACER_H
@@ -0,0 +1,265 @@
+// benchOptimization.C
+
+#include "AllocationTracker.h"
+#include "EndcapConfiguration.h"
+#include "EndcapSearch.h"
+#include "FilterExpression.h"
+#include "ParameterLattice.h"
+#include "PhaseProfile.h"
+#include "RingKernels.h"
+#include <TEnv.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Single-threaded search of the whole lattice; returns the wall time in seconds and the counters in profile.
+double timeSearch(const EndcapConfiguration& config, const ParameterLattice& lattice, const SearchOptions& options, std::vector<EndcapConfiguration>& config_list,
+                  PhaseProfile& profile) {
+    config_list.clear();
+    auto start = std::chrono::steady_clock::now();
+    ALLOC_PHASE(SearchState);
+    EndcapSearch search(config, lattice, 0, lattice.size(), options);
+    search.run(LONG_MAX, config_list);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    profile = search.getProfile();
+    return seconds;
+}
+
+// Allocation budget of a search, checked with make ALLOC=1: the temporaries of EndcapSearch::run per lattice
+// point, and the allocations per configuration built (its vectors and the growth of the result list)
+const double kMaxSearchAllocationsPerPoint = 1e-3;
+const double kMaxAllocationsPerResult = 8;
+
+// Allocations of one search run
+struct RunAllocations {
+    long long search, results, result_bytes, peak;
+};
+
+// Counts the allocations of the search phases from construction, as the difference to these counts
+RunAllocations startCounting() {
+    AllocationTracker::resetPeaks();
+    auto search = AllocationTracker::get(AllocationTracker::Search), results = AllocationTracker::get(AllocationTracker::Results);
+    return RunAllocations{search.allocations, results.allocations, results.bytes, AllocationTracker::getLive()};
+}
+
+RunAllocations stopCounting(const RunAllocations& start) {
+    auto search = AllocationTracker::get(AllocationTracker::Search), results = AllocationTracker::get(AllocationTracker::Results);
+    return RunAllocations{search.allocations - start.search, results.allocations - start.results, results.bytes - start.result_bytes,
+                          AllocationTracker::getPeak() - start.peak};
+}
+
+// Prints the allocations of a run; false if they exceed the budget
+bool checkAllocations(const RunAllocations& run, long long points, std::size_t n_results) {
+    printf("          allocations: search %lld (%.5f per point), results %lld (%.2f and %.0f bytes per result), peak %.2f MB\n", run.search,
+           1.0 * run.search / points, run.results, n_results ? 1.0 * run.results / n_results : 0.0,
+           n_results ? 1.0 * run.result_bytes / n_results : 0.0, run.peak / 1048576.0);
+    bool ok = run.search <= kMaxSearchAllocationsPerPoint * points && run.results <= kMaxAllocationsPerResult * n_results + 64;
+    if (!ok) {
+        printf("Allocation budget exceeded: at most %g per point in the search and %g per result\n", kMaxSearchAllocationsPerPoint,
+               kMaxAllocationsPerResult);
+    }
+    return ok;
+}
+
+bool sameResults(std::vector<EndcapConfiguration>& a, std::vector<EndcapConfiguration>& b) {
+    if (a.size() != b.size()) return false;
+    for (std::size_t i = 0; i < a.size(); ++i) {
+        if (a[i].getTypes() != b[i].getTypes() || a[i].getNpoly() != b[i].getNpoly() || a[i].getL1() != b[i].getL1() || a[i].getL2() != b[i].getL2() ||
+            a[i].getHr() != b[i].getHr() || a[i].getRadius() != b[i].getRadius()) return false;
+    }
+    return true;
+}
+
+// Times the vector kernels alone on inputs from lattice points spread over the lattice: ns per call of
+// prefilterNextRing, firstHrIndex and ringRadii, in that order, with the kernels of the selected level.
+void timeKernels(const EndcapConfiguration& config, const ParameterLattice& lattice, double step, double* ns) {
+    const int samples = 4096;
+    const int repeats = 100;
+    EndcapConfiguration cfg(config);
+    int n_rings = cfg.getNRings();
+    // The rings between the fixed ones have no npoly before the search, they get that of ring 0
+    std::vector<int>& npoly = cfg.getNpoly();
+    for (int& n : npoly) n = n > 2 ? n : cfg.getNMin();
+    std::vector<int> k(ParameterLattice::kMaxLevels);
+    std::vector<float> L1f(samples * kPrefilterLanes);
+    std::vector<double> r(samples), r_min(samples), r_max(samples), L1(samples * cfg.getNspecies()), L2(samples * cfg.getNspecies());
+    std::vector<double> lowest(samples), tallest(samples);
+    for (int s = 0; s < samples; ++s) {
+        lattice.decode(lattice.size() * s / samples, cfg, k.data());
+        for (int i = 0; i < kPrefilterLanes; ++i) L1f[s * kPrefilterLanes + i] = cfg.getL1()[i < cfg.getNspecies() ? i : 0];
+        std::copy(cfg.getL1().begin(), cfg.getL1().end(), L1.begin() + s * cfg.getNspecies());
+        std::copy(cfg.getL2().begin(), cfg.getL2().end(), L2.begin() + s * cfg.getNspecies());
+        r[s] = cfg.getOuterRadius(0);
+        r_min[s] = r[s] * (1 - cfg.getGapTolerance());
+        r_max[s] = std::min(r[s] + cfg.getOverlapMax(), cfg.getRMax());
+        lowest[s] = std::numeric_limits<double>::infinity();
+        tallest[s] = -lowest[s];
+        for (int i = 0; i < n_rings; ++i) {
+            double height = cfg.getOuterRadius(i) - cfg.getInnerRadius(i);
+            lowest[s] = std::min(lowest[s], height);
+            tallest[s] = std::max(tallest[s], height);
+        }
+    }
+    // The same Hr grid and denominators as buildRadius
+    std::vector<double> grid;
+    for (double h = cfg.getHrealMin(); h <= cfg.getHrealMax(); h += step) grid.push_back(h);
+    int n_grid = static_cast<int>(grid.size());
+    grid.resize((grid.size() + kHrLanes - 1) / kHrLanes * kHrLanes, std::numeric_limits<double>::quiet_NaN());
+    int max_npoly = *std::max_element(npoly.begin(), npoly.end());
+    std::vector<double> sin_den(max_npoly + 1), tan_den(max_npoly + 1);
+    for (int n = 3; n <= max_npoly; ++n) {
+        sin_den[n] = 2 * TMath::Sin(TMath::Pi() / n);
+        tan_den[n] = 2 * TMath::Tan(TMath::Pi() / n);
+    }
+    std::vector<double> radius(2 * n_rings);
+
+    int keep[kPrefilterLanes];
+    long checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int repeat = 0; repeat < repeats; ++repeat) {
+        for (int s = 0; s < samples; ++s) {
+            prefilterNextRing(r[s], &L1f[s * kPrefilterLanes], cfg.getNspecies(), r_min[s], r_max[s], keep);
+            checksum += keep[0];
+        }
+    }
+    auto prefiltered = std::chrono::steady_clock::now();
+    for (int repeat = 0; repeat < repeats; ++repeat) {
+        for (int s = 0; s < samples; ++s) {
+            checksum += firstHrIndex(grid.data(), n_grid, lowest[s], tallest[s], cfg.getCosthetaMin(), cfg.getCosthetaMax());
+        }
+    }
+    auto windowed = std::chrono::steady_clock::now();
+    for (int repeat = 0; repeat < repeats; ++repeat) {
+        for (int s = 0; s < samples; ++s) {
+            ringRadii(&L1[s * cfg.getNspecies()], &L2[s * cfg.getNspecies()], cfg.getTypes().data(), npoly.data(), n_rings,
+                      sin_den.data(), tan_den.data(), radius.data());
+            checksum += radius[0] > 0;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    double calls = 1.0 * samples * repeats;
+    ns[0] = std::chrono::duration<double, std::nano>(prefiltered - start).count() / calls;
+    ns[1] = std::chrono::duration<double, std::nano>(windowed - prefiltered).count() / calls;
+    ns[2] = std::chrono::duration<double, std::nano>(end - windowed).count() / calls;
+    if (checksum < 0) printf("%ld\n", checksum);
+}
+
+// Times the cached search and the kernels alone with the kernels of every instruction set level the CPU has.
+int benchKernels(const EndcapConfiguration& config, const ParameterLattice& lattice, double step, int runs) {
+    printf("%-9s %10s %10s %13s %13s %13s\n", "Kernels", "search s", "ns/point", "prefilter ns", "Hr window ns", "radii ns");
+    std::vector<EndcapConfiguration> baseline, results;
+    double baseline_seconds = 0;
+    bool same = true;
+    for (KernelIsa isa : {KernelIsa::Baseline, KernelIsa::Avx2, KernelIsa::Avx512}) {
+        if (!isKernelIsaSupported(isa)) {
+            printf("%-9s not supported by this CPU\n", kernelIsaName(isa));
+            continue;
+        }
+        selectKernelIsa(isa);
+        double best = 0;
+        PhaseProfile profile;
+        for (int run = 0; run < runs; ++run) {
+            double seconds = timeSearch(config, lattice, SearchOptions(), results, profile);
+            if (run == 0 || seconds < best) best = seconds;
+        }
+        double ns[3];
+        timeKernels(config, lattice, step, ns);
+        if (isa == KernelIsa::Baseline) {
+            baseline = results;
+            baseline_seconds = best;
+        } else {
+            same = same && sameResults(baseline, results);
+        }
+        printf("%-9s %10.3f %10.1f %13.2f %13.2f %13.2f   search %.2fx\n", kernelIsaName(isa), best, 1e9 * best / lattice.size(), ns[0], ns[1],
+               ns[2], baseline_seconds / best);
+    }
+    selectKernelIsa();
+    printf("Results identical: %s\n", same ? "yes" : "no");
+    return same ? 0 : 1;
+}
+
+// Results that fail the tolerances they were searched with, which runOptimization --refilter of their store
+// at the same settings would drop; passesTolerances has to repeat the checks of the search exactly.
+std::size_t countRefilterLosses(const EndcapConfiguration& config, const std::vector<EndcapConfiguration>& results) {
+    std::size_t lost = 0;
+    for (auto& cfg : results) {
+        if (!cfg.passesTolerances(config.getGapTolerance(), config.getOverlapMax(), config.getCosthetaMin())) ++lost;
+    }
+    return lost;
+}
+
+// Output filters nested past FilterExpression::kMaxNesting must fail to compile instead of overflowing the stack
+bool checkFilterNesting() {
+    const int deep = 1000000;
+    std::string calls;
+    for (int i = 0; i < deep; ++i) calls += "abs(";
+    FilterExpression filter;
+    std::string error;
+    bool ok = filter.compile(std::string(FilterExpression::kMaxNesting, '-') + "1", 3, 3, error) &&
+              !filter.compile(std::string(2 * deep, '-') + "1", 3, 3, error) &&
+              !filter.compile(std::string(deep, '(') + "1" + std::string(deep, ')'), 3, 3, error) &&
+              !filter.compile(calls + "1" + std::string(deep, ')'), 3, 3, error);
+    printf("Filter nesting limit: %s\n", ok ? "ok" : "failed");
+    return ok;
+}
+
+// Times the search of an ini file with the ring state cache off and on, best of N runs each.
+// With --perf also prints the performance counters per phase of the last run of each.
+// With --kernels times the cached search and the vector kernels on every instruction set level instead.
+// Built with make ALLOC=1 it also prints the allocations of the last run of each mode and fails beyond the budget.
+// Fails as well if a result would not survive --refilter at the tolerances of the ini file,
+// or if a deeply nested output filter does not fail to compile.
+// usage: benchOptimization [--perf | --kernels] [file.ini] [runs]
+int main(int argc, char** argv) {
+    bool perf = argc >= 2 && TString(argv[1]) == "--perf";
+    bool kernels = argc >= 2 && TString(argv[1]) == "--kernels";
+    if (perf || kernels) {
+        --argc;
+        ++argv;
+    }
+    if (!checkFilterNesting()) return 1;
+    TString filename = argc >= 2 ? argv[1] : "optimize.ini";
+    int runs = argc >= 3 ? std::atoi(argv[2]) : 3;
+    TEnv configfile(filename);
+
+    EndcapConfiguration config(configfile);
+    double step_length = configfile.GetValue("step_length", 0.5);
+    ParameterLattice lattice(config, step_length);
+    printf("Lattice points: %lld\n", lattice.size());
+    if (lattice.size() == 0) return 1;
+    if (kernels) return benchKernels(config, lattice, step_length, runs);
+
+    std::vector<EndcapConfiguration> results[2];
+    bool within_budget = true;
+    const char* names[2] = {"uncached", "cached"};
+    for (int mode = 0; mode < 2; ++mode) {
+        SearchOptions options;
+        options.cache_ring_states = mode == 1;
+        options.profile_phases = perf;
+        double best = 0;
+        PhaseProfile profile;
+        RunAllocations allocations{};
+        for (int run = 0; run < runs; ++run) {
+            RunAllocations start = startCounting();
+            double seconds = timeSearch(config, lattice, options, results[mode], profile);
+            allocations = stopCounting(start);
+            if (run == 0 || seconds < best) best = seconds;
+        }
+        printf("%-9s results: %zu  best of %d: %.3f s  %.1f ns/point\n", names[mode], results[mode].size(), runs, best,
+               1e9 * best / lattice.size());
+        if (perf) profile.print();
+        if (AllocationTracker::compiledIn() && runs > 0) within_budget = checkAllocations(allocations, lattice.size(), results[mode].size()) && within_budget;
+    }
+
+    bool same = sameResults(results[0], results[1]);
+    printf("Results identical: %s\n", same ? "yes" : "no");
+    std::size_t lost = countRefilterLosses(config, results[1]);
+    printf("Refilter at the same tolerances keeps: %zu of %zu\n", results[1].size() - lost, results[1].size());
+    return same && within_budget && lost == 0 ? 0 : 1;
+}
@@ -1,204 +1,538 @@
 // runOptimization.C
 
+#include "AllocationTracker.h"
+#include "AnnealingSearch.h"
+#include "AnytimeSearch.h"
 #include "EndcapConfiguration.h"
+#include "EndcapGenerator.h"
+#include "EndcapOptimizer.h"
+#include "EndcapSearch.h"
+#include "FilterExpression.h"
+#include "JobServer.h"
+#include "ParameterLattice.h"
+#include "PhaseProfile.h"
+#include "RejectionStats.h"
+#include "ResultCache.h"
+#include "ResultQuery.h"
+#include "ResultStore.h"
+#include "RingKernels.h"
+#include "RunPlanner.h"
+#include "ThreadPool.h"
+#include "Tracer.h"
 #include <TEnv.h>
 #include <TMath.h>
 #include <iostream>
-#include <functional>
+#include <chrono>
+#include <climits>
 #include <thread>
 #include <vector>
 #include <atomic>
 #include <array>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <cmath>
+
+// Split the lattice range [begin, end) into chunks and submit one search task per chunk.
+// Chunk lists are filled in index order, so the merged result does not depend on the thread count.
+void optimaN(const EndcapConfiguration& config, const ParameterLattice& lattice, std::vector<std::vector<EndcapConfiguration>>& thread_config_lists, long long begin, long long end, const SearchOptions& options, ThreadPool& pool, std::atomic<long>& cycles) {
+    long long n_points = end > begin ? end - begin : 0;
+    long long n_chunks = std::min<long long>(n_points, 16LL * pool.size());
+    thread_config_lists.assign(n_chunks, std::vector<EndcapConfiguration>());  // List for each chunk
+
+    for (long long i = 0; i < n_chunks; ++i) {
+        long long chunk_begin = begin + n_points * i / n_chunks;
+        long long chunk_end = begin + n_points * (i + 1) / n_chunks;
+        auto& thread_config_list = thread_config_lists[i];
+        pool.submit([=, &config, &lattice, &thread_config_list, &cycles]() {
+            TRACE_SPAN("chunk", Tasks);
+            ALLOC_PHASE(SearchState);
+            EndcapSearch search(config, lattice, chunk_begin, chunk_end, options); // Copy the configuration for each task
+            search.run(LONG_MAX, thread_config_list);
+            cycles += search.getCycles();
+        });
+    }
+}
+
+// Combine all thread-specific config lists into the main config_list
+void mergeConfigLists(std::vector<std::vector<EndcapConfiguration>>& thread_config_lists, std::vector<EndcapConfiguration>& config_list) {
+    for (auto& thread_list : thread_config_lists) {
+        config_list.insert(config_list.end(), std::make_move_iterator(thread_list.begin()), std::make_move_iterator(thread_list.end()));
+        thread_list.clear();
+    }
+}
 
-std::atomic<long> cycles(0);
+// Selection applied to the printed results: Output_filter, compiled once by readOutputFilter
+static FilterExpression output_filter;
 
-int inline Roundn(double n) {
-    return TMath::Nint(n);
+bool passesOutputFilter(EndcapConfiguration& cfg) {
+    return output_filter.accepts(cfg);
 }
 
-double inline RoundtoN(double i, double n) {
-    // Divide i by n, round to the nearest integer, and then multiply by n
-    return TMath::Nint(i / n) * n;
+int setupOutputFilter(TEnv& configfile, const EndcapConfiguration& config) {
+    std::string error;
+    if (!readOutputFilter(configfile, config, output_filter, error)) {
+        std::cerr << "Error: " << error << std::endl;
+        return 0;
+    }
+    return 1;
 }
 
-int inline RoundtoN(double i, int n) {
-    // Divide i by n, round to the nearest integer, and then multiply by n
-    return TMath::Nint(i / n) * n;
+// Score: min_costheta, mean_costheta or an expression over the result fields, e.g. mean(costheta) - 0.01 * abs(Hr[0] - Hr[1]);
+// an empty function and a message if it does not compile
+AnytimeSearch::Score readScore(TEnv& configfile, const EndcapConfiguration& config, TString& score_name) {
+    score_name = configfile.GetValue("Score", "min_costheta");
+    AnytimeSearch::Score score = AnytimeSearch::scoreByName(score_name);
+    if (score) return score;
+    auto expression = std::make_shared<FilterExpression>();
+    std::string error;
+    if (!expression->compile(score_name.Data(), config.getNspecies(), config.getNRings(), error)) {
+        std::cerr << "Error: Score is neither min_costheta, mean_costheta nor an expression: " << error << std::endl;
+        return AnytimeSearch::Score();
+    }
+    return [expression](const EndcapConfiguration& cfg) { return expression->evaluate(cfg); };
 }
 
-int inline intToBinary(int n, int digit) {
-    // Shift the number right by (digit - 1) and then extract the least significant bit
-    return (n >> (digit - 1)) & 1;
+// Settings whose mode keeps, ranks or chains layouts of a single ring count, so it cannot run with N_rings_max;
+// nullptr if none is set
+const char* singleRingCountSetting(TEnv& configfile) {
+    if (TString(configfile.GetValue("Disk_radii", "")).Length() > 0) return "Disk_radii";
+    if (configfile.GetValue("Anneal_steps", 0.0) > 0) return "Anneal_steps";
+    if (configfile.GetValue("Time_budget", 0.0) > 0 || configfile.GetValue("Point_budget", 0.0) > 0) return "The anytime search";
+    if (TString(configfile.GetValue("Result_store", "")).Length() > 0) return "Result_store";
+    if (TString(configfile.GetValue("Result_cache", "")).Length() > 0) return "Result_cache";
+    return nullptr;
 }
 
-int inline intPow(int x, unsigned int p) {
-  if (p == 0) return 1;
-  if (p == 1) return x;
-  if (p == 2) return x * x;
-  
-  int tmp = intPow(x, p / 2);
-  if (p % 2 == 0) return tmp * tmp;
-  else return x * tmp * tmp;
+void printResultsByRings(int min_rings, int max_rings, const std::vector<long>& results_by_rings) {
+    for (int n = min_rings; n <= max_rings; ++n) printf("Results with %d rings: %ld\n", n, results_by_rings[n]);
 }
 
-// find the n and type of the next ring using current l2 and n.
-std::vector<int> nextCircles(int currentRing, EndcapConfiguration& config) {
-    auto& L1 = config.getL1();
-    auto& L2 = config.getL2();
-    auto& types = config.getTypes();
-    std::vector<int> typenext;
+// Lazy search of a shard: print the first max_results configurations passing the output filter and stop there
+int runFirstResults(const EndcapConfiguration& config, double step_length, const SearchOptions& options, int max_results, int shard_index, int shard_count, long& cycles) {
+    if (config.getNspecies() < 3) {
+        std::cerr << "Unsupported number of species: " << config.getNspecies() << std::endl;
+        return 0;
+    }
 
-    if (currentRing < 1) {
-        std::cerr << "current ring cannot be lower than 1!";
-        return typenext;
+    ParameterLattice lattice(config, step_length);
+    long long begin = lattice.size() * shard_index / shard_count;
+    long long end = lattice.size() * (shard_index + 1) / shard_count;
+    printf("Lattice points: %lld, searching [%lld, %lld) for the first %d results\n", lattice.size(), begin, end, max_results);
+
+    EndcapGenerator generator(config, lattice, begin, end, options);
+    EndcapConfiguration cfg(config);
+    int found = 0;
+    std::vector<long> results_by_rings(EndcapSearch::kMaxRings + 1, 0);
+    while (found < max_results && generator.next(cfg)) {
+        if (!passesOutputFilter(cfg)) continue;
+        cfg.printConfiguration();
+        ++results_by_rings[cfg.getNRings()];
+        ++found;
     }
+    cycles = generator.getCycles();
+    printf("Results: %d, stopped before lattice point %lld\n", found, generator.getPosition());
+    if (options.max_rings > config.getNRings()) printResultsByRings(config.getNRings(), options.max_rings, results_by_rings);
+    return 1;
+}
 
-    double r = config.getOuterRadius(currentRing - 1);
+// Read a whitespace separated list of numbers from the ini file
+std::vector<double> readList(TEnv& configfile, const char* key) {
+    std::vector<double> values;
+    std::istringstream stream(configfile.GetValue(key, ""));
+    double value;
+    while (stream >> value) values.push_back(value);
+    return values;
+}
 
-    // check if the next ring is the outer ring
-    if (currentRing + 1 == config.getNRings()) {
-        int i = types[currentRing];
-        auto r_next = config.getInnerRadius(currentRing);
-        auto r_maxn = r * (1 + config.getGapTolerance());
-        if (r_next >= r - config.getOverlapMax() && r_next <= r_maxn) {
-            typenext.push_back(i);
-        }
-        return typenext;
-    }
-
-    for (int i = 0; i < config.getNspecies(); i++) {
-        double polygonSides = EndcapConfiguration::PolygonSides(r, L1[i]);
-        int n_star = static_cast<int>(std::floor(polygonSides));  // floor of PolygonSides
-        bool found = false;
-
-        // Check both floor value and floor + 1 for divisibility by 8
-        for (int delta = 0; delta <= 1; ++delta) {
-            int adjusted_n_star = n_star + delta;
-            
-            // Check if the adjusted n_star is divisible by 8
-            if (adjusted_n_star % 8 == 0) {
-                n_star = adjusted_n_star;
-                found = true;
-                break;
-            }
-        }
-        if (!found) { continue; }
-        auto r_next = EndcapConfiguration::CircumscribedRadius(L1[i], n_star);
-        auto r_maxn = r + config.getOverlapMax();
-        auto r_minn = r * (1 - config.getGapTolerance());
-        if (r_next >= r_minn && r_next <= r_maxn && r_next <= config.getRMax()) {
-            typenext.push_back(i);
-            // We're not setting types and npoly here anymore, as we're collecting all possibilities
-        }
+// One radial segment of a multi-disk endcap
+struct DiskSegment {
+    EndcapConfiguration config;
+    std::unique_ptr<ParameterLattice> lattice;
+    std::vector<std::vector<EndcapConfiguration>> thread_config_lists;
+    std::vector<EndcapConfiguration> config_list;
+    std::vector<int> selected;  // indices of config_list passing the output filter, best Score first
+    std::vector<double> scores; // Score of each config_list entry
+};
+
+// Every combination of the selected layouts of the disks, each disk taken best first. The disks share
+// their boundary radii from Disk_radii, so any layout of one disk joins any layout of the next.
+void collectLayouts(std::vector<DiskSegment>& disks, std::size_t disk, std::vector<int>& layout, std::vector<std::vector<int>>& layouts, std::size_t max_layouts) {
+    if (layouts.size() >= max_layouts) return;
+    if (disk == disks.size()) {
+        layouts.push_back(layout);
+        return;
+    }
+    for (int index : disks[disk].selected) {
+        layout[disk] = index;
+        collectLayouts(disks, disk + 1, layout, layouts, max_layouts);
+        if (layouts.size() >= max_layouts) return;
     }
-    return typenext;
 }
 
-void exploreRingConfigurations(EndcapConfiguration& config, std::vector<EndcapConfiguration>& config_list, int ringNumber, double step) {
-    auto& L1 = config.getL1();
-    auto& L2 = config.getL2();
-    auto& npoly = config.getNpoly();
-    auto& types = config.getTypes();
-
-    if (ringNumber >= config.getNRings()) {
-        EndcapConfiguration vconfig = config;
-        if (vconfig.buildRadius(step)) {
-            //config.printConfiguration();
-            config_list.push_back(std::move(vconfig));
+// Multi-disk mode: Disk_radii lists the segment boundaries, the outer radius of one disk is the inner radius of the next.
+// All disks are searched together on one pool and joined into whole-endcap layouts, the best under Score first.
+int runMultiDisk(const EndcapConfiguration& config, TEnv& configfile, double step_length, const SearchOptions& options, ThreadPool& pool, long& cycles) {
+    std::vector<double> radii = readList(configfile, "Disk_radii");
+    std::vector<double> n_min = readList(configfile, "Disk_N_min");
+    std::vector<double> n_max = readList(configfile, "Disk_N_max");
+    std::size_t n_disks = radii.size() > 1 ? radii.size() - 1 : 0;
+
+    if (n_disks == 0 || n_min.size() != n_disks || n_max.size() != n_disks) {
+        std::cerr << "Error: Disk_radii needs N+1 boundaries and Disk_N_min/Disk_N_max N values each." << std::endl;
+        return 0;
+    }
+    if (config.getNspecies() < 3) {
+        std::cerr << "Unsupported number of species: " << config.getNspecies() << std::endl;
+        return 0;
+    }
+    int max_layouts = configfile.GetValue("Disk_max_layouts", 100);
+    if (max_layouts < 1) {
+        std::cerr << "Error: Disk_max_layouts must be at least 1." << std::endl;
+        return 0;
+    }
+    TString score_name;
+    AnytimeSearch::Score score = readScore(configfile, config, score_name);
+    if (!score) return 0;
+
+    // Per-segment setup is done once, every task of the segment copies it
+    std::vector<DiskSegment> disks;
+    disks.reserve(n_disks);
+    for (std::size_t k = 0; k < n_disks; ++k) {
+        DiskSegment disk{config, nullptr, {}, {}, {}, {}};
+        disk.config.setDiskBounds(radii[k], radii[k + 1], static_cast<int>(n_min[k]), static_cast<int>(n_max[k]));
+        disk.lattice.reset(new ParameterLattice(disk.config, step_length));
+        disks.push_back(std::move(disk));
+    }
+    std::atomic<long> disk_cycles(0);
+    for (auto& disk : disks) {
+        optimaN(disk.config, *disk.lattice, disk.thread_config_lists, 0, disk.lattice->size(), options, pool, disk_cycles);
+    }
+    pool.wait();
+    cycles = disk_cycles;
+
+    for (std::size_t k = 0; k < n_disks; ++k) {
+        auto& disk = disks[k];
+        mergeConfigLists(disk.thread_config_lists, disk.config_list);
+        disk.scores.resize(disk.config_list.size());
+        for (std::size_t i = 0; i < disk.config_list.size(); ++i) {
+            if (!passesOutputFilter(disk.config_list[i])) continue;
+            disk.scores[i] = score(disk.config_list[i]);
+            disk.selected.push_back(i);
         }
-        return;
+        std::stable_sort(disk.selected.begin(), disk.selected.end(), [&disk](int a, int b) { return disk.scores[a] > disk.scores[b]; });
+        printf("Disk %zu  Radius: [%.2f %.2f]  polygon sides: [%d, %d]  configurations: %zu (%zu selected)\n", k + 1,
+               disk.config.getRMin(), disk.config.getRMax(), disk.config.getNMin(), disk.config.getNMax(),
+               disk.config_list.size(), disk.selected.size());
     }
 
-    std::vector<int> typenext = nextCircles(ringNumber, config);
-    for (int type : typenext) {
-        // Save current state
-        int oldType = types[ringNumber];
-        int oldNpoly = npoly[ringNumber];
-
-        // Set new type and npoly
-        types[ringNumber] = type;
-        double r = EndcapConfiguration::InscribedRadius(L2[types[ringNumber - 1]], npoly[ringNumber - 1]);
-        double n_star = EndcapConfiguration::PolygonSides(r, L1[type]);
-        npoly[ringNumber] = RoundtoN(n_star, 8);
-
-        // Recurse to next ring
-        exploreRingConfigurations(config, config_list, ringNumber + 1, step);
-
-        // Restore state for backtracking
-        types[ringNumber] = oldType;
-        npoly[ringNumber] = oldNpoly;
-    }
-}
-
-void optimaN(EndcapConfiguration& config, std::vector<EndcapConfiguration>& config_list, double step_length) {
-    const int N_species = config.getNspecies();
-
-    // Define a recursive lambda to handle nested loops
-    std::function<void(int, EndcapConfiguration&, std::vector<EndcapConfiguration>&, int, double)> nestedLoops =
-    [&](int depth, EndcapConfiguration& cfg, std::vector<EndcapConfiguration>& cfg_list, int thread_id, double step) {
-        auto& L1 = cfg.getL1();
-        auto& L2 = cfg.getL2();
-        double L1offset = 0;
-        double L2offset = step / 2;
-        
-        L2offset += step/2 * intToBinary(thread_id, (depth * 2) - 1);
-        L1offset += step/2 * intToBinary(thread_id, (depth * 2));
-
-        // For L2, start from Round(L1) + step
-         for (L2[depth - 1] = Roundn(L1[depth-1]) + L2offset; L2[depth - 1] <= config.getLMax(); L2[depth - 1] += step) {
-            if (depth == N_species - 1) {
-                for (L1[depth] = config.getLMin() + L1offset; L1[depth] <= L2[depth] - step/2; L1[depth] += step) {
-                    ++cycles;
-                    exploreRingConfigurations(cfg, cfg_list, 1, step / 2);
-                }
-            } else {
-                // For intermediate depths, L1 goes from LMin to LMax
-                for (L1[depth] = config.getLMin() + L1offset; L1[depth] <= config.getLMax(); L1[depth] += step) {
-                    nestedLoops(depth + 1, cfg, cfg_list, thread_id, step);
-                }
-            }
+    // One layout more than printed tells whether Disk_max_layouts cut the list short
+    std::vector<int> layout(n_disks, 0);
+    std::vector<std::vector<int>> layouts;
+    collectLayouts(disks, 0, layout, layouts, static_cast<std::size_t>(max_layouts) + 1);
+    bool truncated = layouts.size() > static_cast<std::size_t>(max_layouts);
+    if (truncated) layouts.resize(max_layouts);
+
+    for (std::size_t l = 0; l < layouts.size(); ++l) {
+        printf("=== Endcap layout %zu ===\n", l + 1);
+        for (std::size_t k = 0; k < n_disks; ++k) {
+            printf("-- Disk %zu  Score: %.5f\n", k + 1, disks[k].scores[layouts[l][k]]);
+            disks[k].config_list[layouts[l][k]].printConfiguration();
         }
-    };
+    }
+    if (truncated) {
+        printf("Endcap layouts: %zu, more exist (Disk_max_layouts: %d)\n", layouts.size(), max_layouts);
+    } else {
+        printf("Endcap layouts: %zu\n", layouts.size());
+    }
+    return 1;
+}
 
-    // Function for each thread to execute
-    auto threadWorker = [&](int thread_id, EndcapConfiguration thread_config, std::vector<EndcapConfiguration>& thread_config_list, double step_length) {
-        nestedLoops(1, thread_config, thread_config_list, thread_id, step_length);
-    };
+// Anytime search: spend at most Time_budget seconds or Point_budget lattice points, then print the
+// Best_results best configurations under Score and the fraction of the lattice covered
+int runAnytime(const EndcapConfiguration& config, TEnv& configfile, double step_length, const SearchOptions& options, ThreadPool& pool, long& cycles) {
+    if (config.getNspecies() < 3) {
+        std::cerr << "Unsupported number of species: " << config.getNspecies() << std::endl;
+        return 0;
+    }
+    TString score_name;
+    AnytimeSearch::Score score = readScore(configfile, config, score_name);
+    if (!score) return 0;
+    double time_budget = configfile.GetValue("Time_budget", 0.0);
+    long long point_budget = static_cast<long long>(configfile.GetValue("Point_budget", 0.0));
+    int n_best = configfile.GetValue("Best_results", 10);
+
+    ParameterLattice lattice(config, step_length);
+    printf("Lattice points: %lld, anytime search with budget %.1f s, %lld points (0: none)\n", lattice.size(), time_budget, point_budget);
+
+    AnytimeSearch search(config, lattice, options, passesOutputFilter, score, n_best);
+    search.run(pool, time_budget, point_budget);
+    cycles = search.getPointsDone();
+
+    auto& best = search.getBest();
+    printf("=== Best %zu of %ld results by %s ===\n", best.size(), search.getResults(), score_name.Data());
+    for (auto& scored : best) {
+        printf("Score: %.5f\n", scored.score);
+        scored.config.printConfiguration();
+    }
+    printf("Covered: %lld of %lld lattice points (%.2f%%)\n", search.getPointsDone(), lattice.size(), 100 * search.getCoverage());
+    return 1;
+}
+
+// Stochastic search: Anneal_chains parallel tempering chains take Anneal_steps steps each over the L lattice,
+// then print the Best_results best configurations found under Score
+int runAnneal(const EndcapConfiguration& config, TEnv& configfile, double step_length, const SearchOptions& options, ThreadPool& pool, long& cycles) {
+    if (config.getNspecies() < 3) {
+        std::cerr << "Unsupported number of species: " << config.getNspecies() << std::endl;
+        return 0;
+    }
+    TString score_name;
+    AnytimeSearch::Score score = readScore(configfile, config, score_name);
+    if (!score) return 0;
+    AnnealingSearch::Settings settings;
+    settings.steps = static_cast<long>(configfile.GetValue("Anneal_steps", 0.0));
+    settings.chains = configfile.GetValue("Anneal_chains", std::max(8, pool.size()));
+    settings.t_min = configfile.GetValue("Anneal_t_min", settings.t_min);
+    settings.t_max = configfile.GetValue("Anneal_t_max", settings.t_max);
+    settings.seed = configfile.GetValue("Anneal_seed", 1);
+    if (settings.t_min <= 0 || settings.t_max < settings.t_min) {
+        std::cerr << "Error: need 0 < Anneal_t_min <= Anneal_t_max." << std::endl;
+        return 0;
+    }
+    int n_best = configfile.GetValue("Best_results", 10);
+
+    ParameterLattice lattice(config, step_length);
+    printf("Lattice points: %lld, annealing with %d chains of %ld steps, T in [%g, %g]\n", lattice.size(), settings.chains,
+           settings.steps, settings.t_min, settings.t_max);
+
+    AnnealingSearch search(config, lattice, options, passesOutputFilter, score, n_best, settings);
+    search.run(pool);
+    cycles = search.getEvaluations();
+
+    auto& best = search.getBest();
+    printf("=== Best %zu results by %s ===\n", best.size(), score_name.Data());
+    for (auto& scored : best) {
+        printf("Score: %.5f\n", scored.score);
+        scored.config.printConfiguration();
+    }
+    printf("Evaluated: %lld lattice points, %lld temperature swaps\n", search.getEvaluations(), search.getSwaps());
+    return 1;
+}
+
+// Seconds as a short human-readable duration
+std::string formatDuration(double seconds) {
+    char text[32];
+    if (seconds < 120) snprintf(text, sizeof(text), "%.1f s", seconds);
+    else if (seconds < 7200) snprintf(text, sizeof(text), "%.1f min", seconds / 60);
+    else if (seconds < 172800) snprintf(text, sizeof(text), "%.1f h", seconds / 3600);
+    else snprintf(text, sizeof(text), "%.1f days", seconds / 86400);
+    return text;
+}
+
+// Dry run: count the lattice exactly, search a sample of it and extrapolate the full scan,
+// then suggest a shard count or a coarser step that fits Plan_budget seconds.
+int runPlan(const EndcapConfiguration& config, TEnv& configfile, double step_length, const SearchOptions& options, int n_threads) {
+    if (config.getNspecies() < 3) {
+        std::cerr << "Unsupported number of species: " << config.getNspecies() << std::endl;
+        return 0;
+    }
+    if (TString(configfile.GetValue("Disk_radii", "")).Length() > 0) {
+        std::cerr << "Error: --plan covers single-disk scans only." << std::endl;
+        return 0;
+    }
 
-    // Create and launch threads
-    int num_threads = intPow(2, (N_species - 1) * 2);
-    std::vector<std::thread> threads;
-    std::vector<std::vector<EndcapConfiguration>> thread_config_lists(num_threads);  // List for each thread
+    ParameterLattice lattice(config, step_length);
+    double budget = configfile.GetValue("Plan_budget", 3600.0);
+    RunEstimate estimate = estimateRun(config, lattice, options, passesOutputFilter,
+                                       configfile.GetValue("Plan_blocks", 256), configfile.GetValue("Plan_block_points", 4096));
+    double total_seconds = estimate.seconds_per_point * estimate.lattice_points / n_threads;
 
-    for (int i = 0; i < num_threads; ++i) {
-        EndcapConfiguration thread_config = config; // Copy the configuration for each thread
-        auto stepby2 = step_length * 2;
-        threads.emplace_back(threadWorker, i, std::move(thread_config), std::ref(thread_config_lists[i]), stepby2);
+    printf("Lattice points: %lld (exact, %d levels, step %.3g mm)\n", estimate.lattice_points, lattice.getNLevels(), step_length);
+    printf("Sampled: %lld points in %d blocks\n", estimate.sampled_points, estimate.blocks);
+    if (options.max_rings > config.getNRings()) {
+        printf("Ring counts: %d to %d in one pass, the estimates cover all of them\n", config.getNRings(), options.max_rings);
     }
+    printf("Time per point: %.1f ns on one thread\n", 1e9 * estimate.seconds_per_point);
+    printf("Points with a complete chain: %.4g%%\n", 100 * estimate.point_survival);
+    printf("Estimated configurations built: %.0f\n", estimate.results_per_point * estimate.lattice_points);
+    if (estimate.kept_per_point > 0) {
+        printf("Estimated results passing the filter: %.0f +- %.0f\n", estimate.kept_per_point * estimate.lattice_points,
+               estimate.kept_per_point_error * estimate.lattice_points);
+    } else {
+        // None in the sample: the rule of three gives a 95% upper bound
+        printf("Estimated results passing the filter: fewer than %.0f (none in the sample)\n",
+               3.0 * estimate.lattice_points / std::max<long long>(estimate.sampled_points, 1));
+    }
+    printf("Estimated run time: %s on %d threads\n", formatDuration(total_seconds).c_str(), n_threads);
+    printf("Budget: %s\n", formatDuration(budget).c_str());
 
-    // Join threads
-    for (auto& thread : threads) {
-        thread.join();
+    if (total_seconds <= budget) {
+        printf("Plan: fits the budget as is.\n");
+        return 1;
+    }
+    int shards = static_cast<int>(std::ceil(total_seconds / budget));
+    printf("Plan: Shard_count: %d with one shard per machine of %d threads, about %s each\n", shards, n_threads,
+           formatDuration(total_seconds / shards).c_str());
+
+    // Coarser steps, assuming the same cost per point
+    const double factors[] = {1.25, 1.5, 2, 2.5, 3, 4, 5, 6, 8, 10, 15, 20};
+    for (double factor : factors) {
+        ParameterLattice coarse(config, step_length * factor);
+        double seconds = estimate.seconds_per_point * coarse.size() / n_threads;
+        if (seconds <= budget) {
+            printf("Plan: step_length: %.4g gives %lld points, about %s\n", step_length * factor, coarse.size(),
+                   formatDuration(seconds).c_str());
+            return 1;
+        }
     }
+    printf("Plan: no step up to %gx the current one fits, shard the scan.\n", factors[sizeof(factors) / sizeof(factors[0]) - 1]);
+    return 1;
+}
 
-    // Combine all thread-specific config lists into the main config_list
-    for (const auto& thread_list : thread_config_lists) {
-        config_list.insert(config_list.end(), thread_list.begin(), thread_list.end());
+// Server mode: runOptimization --serve [jobs.jsonl | - | unix:/path/to/socket] [base.ini]
+int runServer(int argc, char** argv) {
+    TString source = argc >= 3 ? argv[2] : "-";
+    TString base_ini = argc >= 4 ? argv[3] : "optimize.ini";
+    TEnv configfile(base_ini);
+    ThreadPool pool(configfile.GetValue("N_threads", 0));
+    JobServer server(base_ini, pool);
+
+    if (source == "-") {
+        server.serveStream(stdin, stdout);
+        return 1;
+    }
+    if (source.BeginsWith("unix:")) {
+        return server.serveSocket(source.Data() + 5);
+    }
+    FILE* jobs = fopen(source.Data(), "r");
+    if (!jobs) {
+        std::cerr << "Error: cannot open " << source << std::endl;
+        return 0;
     }
+    server.serveStream(jobs, stdout);
+    fclose(jobs);
+    return 1;
 }
 
-// Main function
-void runOptimization(EndcapConfiguration config, std::vector<EndcapConfiguration>& config_list, double step_length) {
-    
-    if (config.getNspecies() >= 3) {
-        optimaN(config , config_list, step_length);
-    } else {
-        std::cerr << "Unsupported number of species: " << config.getNspecies() << std::endl;
+// Scan [begin, end) through the result cache in directory: the cached segments are read, the rest is searched
+// and added to the cache. Every configuration passing the output filter goes to on_result, in lattice order;
+// on_searched sees the optimizer of every searched range after its run.
+int runCached(const EndcapConfiguration& config, double step_length, const SearchOptions& options, const char* directory,
+              long long begin, long long end, ThreadPool& pool, const EndcapOptimizer::ResultCallback& on_result,
+              const std::function<void(const EndcapOptimizer&)>& on_searched) {
+    ResultCache cache(directory, config, step_length, options);
+    if (!cache.open()) return 0;
+    std::vector<ResultCache::Piece> pieces = cache.plan(begin, end);
+    long long cached = 0;
+    int n_segments = 0;
+    for (auto& piece : pieces) {
+        if (piece.path.empty()) continue;
+        cached += piece.end - piece.begin;
+        ++n_segments;
+    }
+    printf("Result cache: key %016llx, %lld of %lld lattice points cached in %d segments\n",
+           static_cast<unsigned long long>(cache.getKey()), cached, end - begin, n_segments);
+
+    for (auto& piece : pieces) {
+        if (!piece.path.empty()) {
+            if (!cache.read(piece, [&on_result](EndcapConfiguration& cfg) {
+                    if (passesOutputFilter(cfg)) on_result(cfg);
+                })) return 0;
+            continue;
+        }
+        // The cache keeps every built configuration, so that other output filters can use it too
+        EndcapOptimizer optimizer(config, step_length, options);
+        optimizer.setRange(piece.begin, piece.end);
+        ResultStore segment(config, step_length);
+        std::string pending = cache.pendingPath(piece);
+        if (!segment.open(pending.c_str())) return 0;
+        optimizer.run(pool, [&segment, &on_result](EndcapConfiguration& cfg) {
+            segment.add(cfg);
+            if (passesOutputFilter(cfg)) on_result(cfg);
+        });
+        on_searched(optimizer);
+        if (!segment.close() || !cache.publish(piece)) {
+            std::remove(pending.c_str());
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Filter a result store again at the tolerances of an ini file: --refilter STORE [tight.ini]
+int runRefilter(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: runOptimization --refilter STORE [optimize.ini]" << std::endl;
+        return 0;
+    }
+    TString filename = argc >= 4 ? argv[3] : "optimize.ini";
+    TEnv configfile(filename);
+    EndcapConfiguration config(configfile);
+    double step_length = configfile.GetValue("step_length", 0.5);
+    if (!setupOutputFilter(configfile, config)) return 0;
+
+    std::vector<EndcapConfiguration> stored;
+    if (!ResultStore::load(argv[2], config, step_length, stored)) return 0;
+
+    printf("Gap_tolerance: %.2e, Overlap_max_mm: %.3f, costheta_min: %.5f\n", config.getGapTolerance(), config.getOverlapMax(),
+           config.getCosthetaMin());
+    long kept = 0;
+    for (auto& cfg : stored) {
+        if (!cfg.passesTolerances(config.getGapTolerance(), config.getOverlapMax(), config.getCosthetaMin())) continue;
+        if (!passesOutputFilter(cfg)) continue;
+        cfg.printConfiguration();
+        EndcapConfiguration::ToleranceSlack slack = cfg.computeSlack();
+        printf("Slack: gap %.3e overlap %.3f costheta %.5f\n", slack.gap, slack.overlap, slack.costheta);
+        ++kept;
+    }
+    printf("Results: %ld of %zu stored\n", kept, stored.size());
+    return 1;
+}
+
+// Answer a filter over a result store from its indexes: --query STORE TERM...
+int runQuery(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: runOptimization --query STORE [npoly=96,112,112] [types=0,1,2] [Hr<135] [r_in[1]>=740] ..." << std::endl;
+        return 0;
+    }
+    auto start = std::chrono::steady_clock::now();
+    ResultQuery query;
+    if (!query.open(argv[2])) return 0;
+    for (int i = 3; i < argc; ++i) {
+        if (!query.addTerm(argv[i])) return 0;
     }
+    std::vector<long long> matching = query.run();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    // Only the shape of the configuration matters for printing
+    TEnv shape;
+    shape.SetValue("N_species", query.getHeader().n_species);
+    shape.SetValue("N_rings", query.getHeader().n_rings);
+    EndcapConfiguration cfg(shape);
+    for (long long record : matching) {
+        query.fill(record, cfg);
+        cfg.printConfiguration();
+    }
+    printf("Matches: %zu of %lld stored, %lld candidates from %s in %.3f ms\n", matching.size(), query.getHeader().n_records,
+           query.getCandidates(), query.getAccessPath().c_str(), ms);
+    return 1;
 }
 
 // Entry point for ROOT
 int main(int argc,char**argv) {
+    if (argc >= 2 && TString(argv[1]) == "--serve") return runServer(argc, argv) ? 0 : 1;
+    if (argc >= 2 && TString(argv[1]) == "--refilter") return runRefilter(argc, argv) ? 0 : 1;
+    if (argc >= 2 && TString(argv[1]) == "--query") return runQuery(argc, argv) ? 0 : 1;
+
+    // --plan estimates the scan of the ini file instead of running it
+    bool plan = argc >= 2 && TString(argv[1]) == "--plan";
+    if (plan) {
+        --argc;
+        ++argv;
+    }
+
     TString filename;
     if(argc>=2){
         filename = argv[1];
@@ -223,15 +557,125 @@ int main(int argc,char**argv) {
 
     std::cout << L1[0] << " " << L2[config.getNspecies() - 1] << std::endl;
 
-    std::vector<EndcapConfiguration> config_list;
-    runOptimization(config, config_list, step_length);
+    // Spans of the search threads, written when the program exits
+    TString trace_path = configfile.GetValue("Trace_file", "");
+    if (trace_path.Length() > 0 && !Tracer::compiledIn()) {
+        std::cerr << "Warning: Trace_file is ignored, build with make TRACE=1 for tracing" << std::endl;
+    } else if (trace_path.Length() > 0) {
+        Tracer::start(trace_path.Data(), configfile.GetValue("Trace_level", 2), configfile.GetValue("Trace_events", 1 << 16));
+    }
+
+    // Allocations per phase, printed when the program exits
+    if (AllocationTracker::compiledIn()) AllocationTracker::printAtExit();
+
+    // Vector kernels for the best instruction set of this CPU, at most Kernel_isa
+    KernelIsa kernel_isa;
+    if (!parseKernelIsa(configfile.GetValue("Kernel_isa", "auto"), kernel_isa)) {
+        std::cerr << "Error: unknown Kernel_isa " << configfile.GetValue("Kernel_isa", "") << ", use auto, baseline, avx2 or avx512." << std::endl;
+        return 1;
+    }
+    printf("Kernels: %s\n", kernelIsaName(selectKernelIsa(kernel_isa)));
+
+    ThreadPool pool(configfile.GetValue("N_threads", 0));
+    SearchOptions options;
+    std::string error;
+    if (!readSearchOptions(configfile, options, error)) {
+        std::cerr << "Error: " << error << "." << std::endl;
+        return 1;
+    }
+    if (!setupOutputFilter(configfile, config)) return 1;
+    // N_rings_max: the ring counts N_rings..N_rings_max are searched in one pass. The full scan and Max_results
+    // count their results per ring count and --plan estimates the whole pass; the other modes keep one count.
+    bool ring_range = options.max_rings > config.getNRings();
+    if (ring_range) {
+        const char* single_count = singleRingCountSetting(configfile);
+        if (single_count) {
+            std::cerr << "Error: " << single_count << " covers a single ring count, unset N_rings_max." << std::endl;
+            return 1;
+        }
+        printf("N_rings_max: %d\n", options.max_rings);
+    }
+    if (plan) return runPlan(config, configfile, step_length, options, pool.size()) ? 0 : 1;
+
+    long cycles = 0;
+    if (TString(configfile.GetValue("Disk_radii", "")).Length() > 0) {
+        if (!runMultiDisk(config, configfile, step_length, options, pool, cycles)) return 1;
+        std::cout << "Total cycles: " << cycles << std::endl;
+        return 0;
+    }
 
-    for(auto& cfg : config_list) {
-        auto np = cfg.getNpoly();
-        if (abs(np[1] - np[2]) <= 1) {cfg.printConfiguration();}
-        //cfg.printConfiguration();
+    int shard_count = configfile.GetValue("Shard_count", 1);
+    int shard_index = configfile.GetValue("Shard_index", 0);
+    if (shard_count < 1 || shard_index < 0 || shard_index >= shard_count) {
+        std::cerr << "Error: Shard_index must be in [0, Shard_count)." << std::endl;
+        return 1;
+    }
+
+    if (configfile.GetValue("Anneal_steps", 0.0) > 0) {
+        runAnneal(config, configfile, step_length, options, pool, cycles);
+        std::cout << "Total cycles: " << cycles << std::endl;
+        return 0;
+    }
+
+    if (configfile.GetValue("Time_budget", 0.0) > 0 || configfile.GetValue("Point_budget", 0.0) > 0) {
+        runAnytime(config, configfile, step_length, options, pool, cycles);
+        std::cout << "Total cycles: " << cycles << std::endl;
+        return 0;
+    }
+
+    int max_results = configfile.GetValue("Max_results", 0);
+    if (max_results > 0) {
+        runFirstResults(config, step_length, options, max_results, shard_index, shard_count, cycles);
+        std::cout << "Total cycles: " << cycles << std::endl;
+        return 0;
+    }
+
+    EndcapOptimizer optimizer(config, step_length, options);
+    optimizer.setShard(shard_index, shard_count);
+    optimizer.setFilter(passesOutputFilter);
+    printf("Lattice points: %lld, searching [%lld, %lld)\n", optimizer.getLatticeSize(), optimizer.getBegin(), optimizer.getEnd());
+
+    // Keep the results with their tolerance slack for runOptimization --refilter
+    TString store_path = configfile.GetValue("Result_store", "");
+    TString cache_directory = configfile.GetValue("Result_cache", "");
+    ResultStore store(config, step_length);
+    store.setMemoryLimit(static_cast<std::size_t>(std::max(configfile.GetValue("Result_memory_mb", 256), 1)) << 20);
+    if (store_path.Length() > 0 && !store.open(store_path.Data())) return 1;
+    std::vector<long> results_by_rings(EndcapSearch::kMaxRings + 1, 0);
+    auto on_result = [&store, &results_by_rings](EndcapConfiguration& cfg) {
+        ALLOC_PHASE(Output);
+        cfg.printConfiguration();
+        store.add(cfg);
+        ++results_by_rings[cfg.getNRings()];
+    };
+    // Only the lattice points searched now are counted, not those answered from the result cache
+    long long points = 0;
+    RejectionStats rejections;
+    PhaseProfile profile;
+    auto on_searched = [&](const EndcapOptimizer& searched) {
+        points += searched.getPointsDone();
+        rejections.merge(searched.getRejections());
+        profile.merge(searched.getProfile());
+    };
+    if (cache_directory.Length() > 0) {
+        if (!runCached(config, step_length, options, cache_directory.Data(), optimizer.getBegin(), optimizer.getEnd(), pool, on_result,
+                       on_searched)) return 1;
+    } else {
+        optimizer.run(pool, on_result);
+        on_searched(optimizer);
+    }
+    if (ring_range) {
+        printResultsByRings(config.getNRings(), options.max_rings, results_by_rings);
+    }
+    if (options.count_rejections) rejections.print(config.getNRings());
+    if (options.profile_phases) profile.print();
+    if (store_path.Length() > 0) {
+        ALLOC_PHASE(Output);
+        int runs = store.getRuns();
+        if (!store.close()) return 1;
+        printf("Stored %ld results in %s (%d spilled runs)\n", store.getCount(), store_path.Data(), runs);
     }
 
-    std::cout << "Total cycles: " << cycles.load() << std::endl;
+    std::cout << "Total cycles: " << points << std::endl;
     return 0;
 }
\ No newline at end of file